@@ -31,6 +31,9 @@
 #   argument)
 # . UIDs and GIDs are resolved, if the the resolution fails: IDs are printed as
 #   `#ID` (`#` followed by the UID/GID), 
+# . The names table written by `fist` at scan time (`-o ids:FILE`) can be
+#   provided with `-I`, IDs are then resolved with this table (not on the host
+#   running the script, which may not use the same users/groups database)
 #
 import argparse
 import functools
@@ -42,6 +45,7 @@ import re
 import statistics
 import time
 import sys
+import urllib.parse
 from collections import defaultdict
 from datetime import datetime
 from datetime import timezone
@@ -83,11 +87,28 @@ def update_object_depth_and_length(name, users, user):
         users[user]['maxdepth'] = d
 
 
+#
+# UIDs/GIDs names table from a `fist` "ids" output ("u:UID:name" and
+# "g:GID:name" lines, percent-encoded names, empty if unknown)
+#
+idnames = None
+
+def load_ids_file(filename):
+    table = {}
+    with open(filename, 'r') as f:
+        for line in f:
+            kind, xid, name = line.rstrip('\n').split(':', 2)
+            table[(kind, int(xid))] = urllib.parse.unquote(name)
+    return table
+
 #
 # Resolve "uid" UID to a human readable name
 #
 @functools.cache
 def resolve_uid(uid):
+    if idnames is not None:
+        username = idnames.get(('u', uid)) or f'#{uid}'
+        return f'{username}'
     try:
        username = pwd.getpwuid(uid).pw_name
     except KeyError:
@@ -100,6 +121,9 @@ def resolve_uid(uid):
 #
 @functools.cache
 def resolve_gid(gid):
+    if idnames is not None:
+        groupname = idnames.get(('g', gid)) or f'#{gid}'
+        return f'{groupname}'
     try:
        groupname = grp.getgrgid(gid).gr_name
     except KeyError:
@@ -347,6 +371,9 @@ if __name__ == "__main__":
     parser.add_argument('-g', '--group', required=True, help="Expected group name")
     parser.add_argument('-o', '--outputfile', help="JSON Output filename")
     parser.add_argument('-S', '--specialgroup', help="Group with special treatment (root-owned objects and multiple groups allowed)")
+    parser.add_argument('-I', '--idsfile', help="UIDs/GIDs names table (from a 'fist' \"ids\" output)")
     args = parser.parse_args()
+    if args.idsfile:
+        idnames = load_ids_file(args.idsfile)
     analyze_fist_file(args.filename, args.group, args.outputfile, args.histofile, args.specialgroup)
 
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2006-2024 IN2P3 Computing Centre
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * For questions, comments or bug reports please contact the author.
+ *
+ */
+
+/*
+ * fist-convert: convert a "fist" dump between the text and binary formats
+ * (the input format is found from its content).
+ * The input is split in chunks (on line/record boundaries) converted
+ * concurrently, the converted chunks are written in order.
+ * Converting a text dump to binary and back gives the same text dump.
+ *
+ * Notes:
+ * . the text format has 32 bits dates and KiB counts, so a binary dump
+ *   converted from a text dump has the (unsigned) 32 bits values;
+ * . every input record is converted or the conversion fails (with the
+ *   record number), the number of records is printed with "-v".
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE	/* O_CLOEXEC, madvise() */
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fist.h"
+
+#define CHUNK_SIZE	(16 * 1024 * 1024)	/* input bytes per thread */
+#define JOBS_MAX	256
+
+struct chunk {
+	const unsigned char	*in;
+	size_t			 len;
+	unsigned char		*out;
+	size_t			 outlen;
+	size_t			 outsize;
+	uint64_t		 nrecs;
+	const char		*err;		/* conversion error */
+	pthread_t		 thread;
+};
+
+static void usage(void);
+static void error(const int, const int, const char *, ...);
+static void *to_bin(void *);
+static void *to_text(void *);
+static unsigned char *reserve(struct chunk *, const size_t);
+static int parse_number(const unsigned char **, const unsigned char *,
+	const int, uint64_t *);
+static size_t decode(unsigned char *, const unsigned char *, const size_t);
+static unsigned char *encode(unsigned char *, const unsigned char *,
+	const size_t);
+
+static const char	hexdigits[] = "0123456789ABCDEF";
+
+
+int
+main(int argc, char *argv[])
+{
+	struct chunk	 chunks[JOBS_MAX];
+	struct stat	 sb;
+	char		*e = NULL;
+	unsigned long	 l;
+	const unsigned char *map = NULL, *p = NULL, *end = NULL, *q = NULL;
+	FILE		*out = NULL;
+	void		*(*convert)(void *) = NULL;
+	uint64_t	 nrecs = 0, outbytes = 0, reclen;
+	unsigned	 jobs, i, n;
+	long		 ncpus;
+	int		 fd, ch, verbose = 0, tobin;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpus = 1;
+	jobs = ncpus > JOBS_MAX ? JOBS_MAX : (unsigned) ncpus;
+
+	while ((ch = getopt(argc, argv, "j:v")) != -1) {
+		switch (ch) {
+		case 'j':
+			errno = 0;
+			l = strtoul(optarg, &e, 10);
+			if (errno != 0 || e == optarg || *e != '\0'
+			    || *optarg == '-' || l == 0 || l > JOBS_MAX)
+				error(1, -1, "Invalid number of jobs '%s'",
+				    optarg);
+			jobs = (unsigned) l;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		usage();
+
+	if ((fd = open(argv[0], O_RDONLY | O_CLOEXEC)) == -1)
+		error(1, errno, "Unable to open '%s'", argv[0]);
+	if (fstat(fd, &sb) == -1)
+		error(1, errno, "Unable to stat '%s'", argv[0]);
+	if (!S_ISREG(sb.st_mode))
+		error(1, -1, "'%s' is not a regular file", argv[0]);
+	if (sb.st_size > 0 && (map = mmap(NULL, (size_t) sb.st_size,
+	    PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		error(1, errno, "Unable to map '%s'", argv[0]);
+	close(fd);
+	p = map;
+	end = map + sb.st_size;
+	if (map != NULL)
+		(void) madvise((void *) map, (size_t) sb.st_size,
+		    MADV_SEQUENTIAL);
+
+	tobin = !(sb.st_size >= FIST_BIN_MAGICLEN
+	    && memcmp(map, FIST_BIN_MAGIC, FIST_BIN_MAGICLEN) == 0);
+	convert = tobin ? to_bin : to_text;
+	if (!tobin)
+		p += FIST_BIN_MAGICLEN;
+
+	if (strcmp(argv[1], "-") == 0)
+		out = stdout;
+	else if ((out = fopen(argv[1], "w")) == NULL)
+		error(1, errno, "Unable to open '%s'", argv[1]);
+	if (tobin && fwrite(FIST_BIN_MAGIC, FIST_BIN_MAGICLEN, 1, out) != 1)
+		error(1, errno, "Unable to write '%s'", argv[1]);
+
+	memset(chunks, 0, sizeof(chunks));
+	while (p < end) {
+		/* Split the next "jobs" chunks on record boundaries */
+		for (n = 0; n < jobs && p < end; n++) {
+			if (tobin) {
+				q = (size_t) (end - p) > CHUNK_SIZE
+				    ? p + CHUNK_SIZE : end;
+				if (q < end && (q = memchr(q, '\n', (size_t)
+				    (end - q))) == NULL)
+					q = end;
+				else if (q < end)
+					q++;
+			} else {
+				/* Truncated records are reported later */
+				for (q = p; q < end && q - p < CHUNK_SIZE;
+				    q += reclen) {
+					if (end - q < FIST_BIN_HDRLEN
+					    || (reclen = FIST_BIN_HDRLEN
+					    + (uint64_t) GET32(q + 56)
+					    + GET32(q + 60)) > (uint64_t)
+					    (end - q)) {
+						q = end;
+						break;
+					}
+				}
+			}
+			chunks[n].in = p;
+			chunks[n].len = (size_t) (q - p);
+			chunks[n].outlen = 0;
+			chunks[n].nrecs = 0;
+			chunks[n].err = NULL;
+			p = q;
+		}
+
+		for (i = 1; i < n; i++)
+			if ((errno = pthread_create(&chunks[i].thread, NULL,
+			    convert, &chunks[i])) != 0)
+				error(1, errno, "Unable to create thread");
+		convert(&chunks[0]);
+		for (i = 1; i < n; i++)
+			pthread_join(chunks[i].thread, NULL);
+
+		for (i = 0; i < n; i++) {
+			if (chunks[i].err != NULL)
+				error(1, -1, "'%s': record %" PRIu64 ": %s",
+				    argv[0], nrecs + chunks[i].nrecs + 1,
+				    chunks[i].err);
+			if (chunks[i].outlen > 0 && fwrite(chunks[i].out,
+			    chunks[i].outlen, 1, out) != 1)
+				error(1, errno, "Unable to write '%s'",
+				    argv[1]);
+			nrecs += chunks[i].nrecs;
+			outbytes += chunks[i].outlen;
+		}
+	}
+
+	if ((out == stdout ? fflush(out) : fclose(out)) == EOF)
+		error(1, errno, "Unable to write '%s'", argv[1]);
+	if (verbose)
+		fprintf(stderr, "fist-convert: %" PRIu64 " records, %s to %s, "
+		    "%" PRIu64 " to %" PRIu64 " bytes\n", nrecs,
+		    tobin ? "text" : "binary", tobin ? "binary" : "text",
+		    (uint64_t) sb.st_size, outbytes + (tobin ?
+		    FIST_BIN_MAGICLEN : 0));
+
+	for (i = 0; i < jobs; i++)
+		free(chunks[i].out);
+	if (map != NULL)
+		munmap((void *) map, (size_t) sb.st_size);
+
+	return (0);
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fist-convert [-v] [-j jobs] input output\n");
+	fprintf(stderr, "The input format (text or binary) is detected, "
+	    "\"-\" output is stdout\n");
+	exit(1);
+}
+
+
+/*
+ * Text lines to binary records.
+ */
+static void *
+to_bin(void *arg)
+{
+	struct chunk		*c = arg;
+	const unsigned char	*p = c->in, *end = c->in + c->len;
+	const unsigned char	*eol = NULL, *name = NULL, *lname = NULL;
+	unsigned char		*hdr = NULL;
+	uint64_t		 v[9];
+	size_t			 nlen, llen, namelen, lnamelen;
+	int			 i;
+
+	for (; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', (size_t) (end - p))) == NULL)
+			eol = end;
+
+		/* blocks:mode:nlinks:uid:gid:size:mtime:atime:ctime:name */
+		for (i = 0; i < 9; i++)
+			if (parse_number(&p, eol, i == 1 ? 8 : 10, &v[i])
+			    == -1) {
+				c->err = "invalid field";
+				return (NULL);
+			}
+		name = p;
+		nlen = (size_t) (eol - p);
+		lname = NULL;
+		llen = 0;
+		if (S_ISLNK((mode_t) v[1])) {
+			for (lname = name; lname + 4 <= eol
+			    && memcmp(lname, " -> ", 4) != 0; lname++)
+				;
+			if (lname + 4 > eol) {
+				c->err = "symlink without value";
+				return (NULL);
+			}
+			nlen = (size_t) (lname - name);
+			lname += 4;
+			llen = (size_t) (eol - lname);
+		}
+
+		hdr = reserve(c, FIST_BIN_HDRLEN + nlen + llen);
+		if ((namelen = decode(hdr + FIST_BIN_HDRLEN, name, nlen))
+		    == (size_t) -1 || (lnamelen = decode(hdr
+		    + FIST_BIN_HDRLEN + namelen, lname, llen)) == (size_t) -1) {
+			c->err = "invalid percent-encoding";
+			return (NULL);
+		}
+		PUT64(hdr, v[0]);
+		PUT64(hdr + 8, v[5]);
+		PUT64(hdr + 16, v[6]);
+		PUT64(hdr + 24, v[7]);
+		PUT64(hdr + 32, v[8]);
+		PUT32(hdr + 40, (uint32_t) v[1]);
+		PUT32(hdr + 44, (uint32_t) v[2]);
+		PUT32(hdr + 48, (uint32_t) v[3]);
+		PUT32(hdr + 52, (uint32_t) v[4]);
+		PUT32(hdr + 56, (uint32_t) namelen);
+		PUT32(hdr + 60, (uint32_t) lnamelen);
+		c->outlen += FIST_BIN_HDRLEN + namelen + lnamelen;
+		c->nrecs++;
+		if (eol == end)
+			break;
+	}
+
+	return (NULL);
+}
+
+
+/*
+ * Binary records to text lines (as printed by print_metadata() in fist).
+ */
+static void *
+to_text(void *arg)
+{
+	struct chunk		*c = arg;
+	const unsigned char	*p = c->in, *end = c->in + c->len;
+	unsigned char		*o = NULL;
+	uint64_t		 nlen, llen;
+	uint32_t		 mode;
+	int			 n;
+
+	while (p < end) {
+		if (end - p < FIST_BIN_HDRLEN) {
+			c->err = "truncated record";
+			return (NULL);
+		}
+		nlen = GET32(p + 56);
+		llen = GET32(p + 60);
+		if ((uint64_t) (end - p) - FIST_BIN_HDRLEN < nlen + llen) {
+			c->err = "truncated record";
+			return (NULL);
+		}
+		mode = GET32(p + 40);
+
+		o = reserve(c, 128 + 3 * (nlen + llen) + 4);
+		n = snprintf((char *) o, 128, "%u:%o:%u:%u:%u:%" PRIu64
+		    ":%u:%u:%u:", (unsigned int) GET64(p), (unsigned int) mode,
+		    (unsigned int) GET32(p + 44), (unsigned int) GET32(p + 48),
+		    (unsigned int) GET32(p + 52), GET64(p + 8),
+		    (unsigned int) GET64(p + 16), (unsigned int) GET64(p + 24),
+		    (unsigned int) GET64(p + 32));
+		o = encode(o + n, p + FIST_BIN_HDRLEN, nlen);
+		if (S_ISLNK((mode_t) mode)) {
+			memcpy(o, " -> ", 4);
+			o = encode(o + 4, p + FIST_BIN_HDRLEN + nlen, llen);
+		}
+		*o++ = '\n';
+		c->outlen = (size_t) (o - c->out);
+		c->nrecs++;
+		p += FIST_BIN_HDRLEN + nlen + llen;
+	}
+
+	return (NULL);
+}
+
+
+/*
+ * Room for "len" more bytes in the output of chunk "c".
+ */
+static unsigned char *
+reserve(struct chunk *c, const size_t len)
+{
+	if (c->outsize - c->outlen < len) {
+		while (c->outsize - c->outlen < len)
+			c->outsize = c->outsize == 0 ? CHUNK_SIZE
+			    : c->outsize * 2;
+		if ((c->out = realloc(c->out, c->outsize)) == NULL)
+			error(1, errno, "Unable to allocate output");
+	}
+	return (c->out + c->outlen);
+}
+
+
+/*
+ * Number followed by a ':' at "*p" (before "end"), "*p" is moved after
+ * the ':'.
+ */
+static int
+parse_number(const unsigned char **p, const unsigned char *end,
+    const int base, uint64_t *v)
+{
+	const unsigned char	*s = *p;
+
+	for (*v = 0; s < end && *s >= '0' && *s < '0' + base; s++)
+		*v = *v * (uint64_t) base + (uint64_t) (*s - '0');
+	if (s == *p || s == end || *s != ':')
+		return (-1);
+	*p = s + 1;
+	return (0);
+}
+
+
+/*
+ * Percent-decode "len" bytes of "s" in "d", returns the decoded length or
+ * -1 on error.
+ */
+static size_t
+decode(unsigned char *d, const unsigned char *s, const size_t len)
+{
+	const unsigned char	*end = s + len;
+	unsigned char		*start = d;
+	const char		*h = NULL, *l = NULL;
+
+	while (s < end) {
+		if (*s != '%') {
+			*d++ = *s++;
+			continue;
+		}
+		if (end - s < 3 || (h = memchr(hexdigits, s[1], 16)) == NULL
+		    || (l = memchr(hexdigits, s[2], 16)) == NULL)
+			return ((size_t) -1);
+		*d++ = (unsigned char) ((h - hexdigits) << 4 | (l - hexdigits));
+		s += 3;
+	}
+	return ((size_t) (d - start));
+}
+
+
+static unsigned char *
+encode(unsigned char *d, const unsigned char *s, const size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) {
+		if (fist_encoded(s[i])) {
+			*d++ = '%';
+			*d++ = (unsigned char) hexdigits[s[i] >> 4];
+			*d++ = (unsigned char) hexdigits[s[i] & 15];
+		} else
+			*d++ = s[i];
+	}
+	return (d);
+}
+
+
+static void
+error(const int exitcode, const int errnum, const char *fmt, ...)
+{
+	va_list	ap;
+
+	fprintf(stderr, "fist-convert: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (errnum != -1)
+		fprintf(stderr, ": %.100s (%d)", strerror(errnum), errnum);
+	fputc('\n', stderr);
+
+	exit(exitcode);
+}
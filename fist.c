@@ -51,28 +51,761 @@
  */
 
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE	/* O_NOATIME */
+#endif
+
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <grp.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#ifdef NEED_STAT64
+#include "fist.h"
+
+#ifdef __linux__
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+# include <sys/vfs.h>
+# include <linux/magic.h>
+# ifdef SYS_openat2
+#  include <linux/openat2.h>
+#  define HAS_OPENAT2
+# endif
+#endif /* __linux__ */
+
+#ifndef O_NOATIME
+# define O_NOATIME	0
+#endif
+
+/*
+ * USDT probes (SystemTap SDT notes in the executable, for bpftrace, perf,
+ * SystemTap...): a nop each until a tracer enables them.
+ * Compiled out without <sys/sdt.h> (systemtap-sdt-dev) or with
+ * -DFIST_NO_PROBES.
+ */
+#if defined(__has_include) && !defined(FIST_NO_PROBES)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define HAS_SDT
+# endif
+#endif /* __has_include && !FIST_NO_PROBES */
+#ifdef HAS_SDT
+# define PROBE1(n, a)		DTRACE_PROBE1(fist, n, a)
+# define PROBE2(n, a, b)	DTRACE_PROBE2(fist, n, a, b)
+# define PROBE3(n, a, b, c)	DTRACE_PROBE3(fist, n, a, b, c)
+#else
+# define PROBE1(n, a)		((void) 0)
+# define PROBE2(n, a, b)	((void) 0)
+# define PROBE3(n, a, b, c)	((void) 0)
+#endif /* HAS_SDT */
+
+#if defined(NEED_STAT64) && !defined(FIST_SIMFS)
 # define FIST_SSTAT	struct stat64
 # define FIST_LSTAT	lstat64
+# define FIST_FSTAT	fstat64
+# define FIST_FSTATAT	fstatat64
 #else
 # define FIST_SSTAT	struct stat
 # define FIST_LSTAT	lstat
+# define FIST_FSTAT	fstat
+# define FIST_FSTATAT	fstatat
 #endif /* NEED_STAT64 */
 
+/*
+ * System calls of the traversal, replaced by the simulated filesystem of
+ * "fist-simfs" (see simfs.c).
+ */
+#ifdef FIST_SIMFS
+# include "simfs.h"
+# undef HAS_OPENAT2
+# define FS_OPEN	sim_open
+# define FS_OPENAT	sim_openat
+# define FS_CLOSE	sim_close
+# define FS_FDOPENDIR	sim_fdopendir
+# define FS_READDIR	sim_readdir
+# define FS_CLOSEDIR	sim_closedir
+# define FS_LSTAT	sim_lstat
+# define FS_FSTAT	sim_fstat
+# define FS_FSTATAT	sim_fstatat
+# define FS_READLINKAT	sim_readlinkat
+#else
+# define FS_OPEN	open
+# define FS_OPENAT	openat
+# define FS_CLOSE	close
+# define FS_FDOPENDIR	fdopendir
+# define FS_READDIR	readdir
+# define FS_CLOSEDIR	closedir
+# define FS_LSTAT	FIST_LSTAT
+# define FS_FSTAT	FIST_FSTAT
+# define FS_FSTATAT	FIST_FSTATAT
+# define FS_READLINKAT	readlinkat
+#endif /* FIST_SIMFS */
+
+/* '.' or '..' */
+#define IS_DOT_OR_DOTDOT(n)	((n)[0] == '.' && ((n)[1] == '\0' \
+				    || ((n)[1] == '.' && (n)[2] == '\0')))
+
+/*
+ * An object, as handed to the outputs ("sinks").
+ */
+struct fist_obj {
+	const char		*name;
+	const char		*parent;	/* NULL for the root */
+	const FIST_SSTAT	*st;		/* NULL with "names only" */
+	const char		*lname;		/* symlink value or NULL */
+	int			 project;	/* -1: none */
+};
+
+/*
+ * Per output selection of objects, "0" means "any" for all fields.
+ */
+struct filter {
+	int		 active;
+	uint64_t	 minsize;
+	uint64_t	 maxsize;
+	time_t		 mtime_before;
+	time_t		 mtime_after;
+	mode_t		 type;
+	long		 uid;		/* -1: any */
+	long		 gid;		/* -1: any */
+};
+
+/*
+ * An output: each has its own stream, buffer and filter.
+ * Every object is handed to all the outputs by the output thread.
+ */
+struct sink;
+struct sink_type {
+	const char	*name;
+	int		 nostat;	/* usable without lstat(2) results */
+	size_t		 bufsize;	/* default buffer size */
+	void		(*open)(struct sink *);
+	void		(*emit)(struct sink *, const struct fist_obj *);
+	void		(*close)(struct sink *);
+};
+
+struct sink {
+	const struct sink_type	*type;
+	const char		*path;		/* "-" is stdout */
+	FILE			*fp;
+	char			*buf;
+	size_t			 bufsize;
+	int			 bufsize_set;	/* "bufsize=N" */
+	size_t			 maxfiles;	/* partitioned outputs */
+	struct filter		 filter;
+	size_t			 index_block;	/* "index=N" */
+	struct index		*index;
+	void			*data;		/* type specific */
+	struct sink		*next;
+};
+
+/*
+ * Counters for aggregated outputs.
+ */
+struct counters {
+	uint64_t	nfiles;
+	uint64_t	ndirs;
+	uint64_t	nsymlinks;
+	uint64_t	nothers;
+	uint64_t	bytes;
+	uint64_t	kib;
+	time_t		latime;
+	time_t		lmtime;
+	time_t		lctime;
+};
+
+/* Per owner (UID or GID) counters, open addressing hash table */
+struct owner {
+	uint32_t	 id;
+	int		 used;
+	struct counters	 c;
+};
+
+struct owners {
+	int		 bygid;
+	size_t		 size;		/* power of 2 */
+	size_t		 count;
+	struct owner	*tab;
+	struct counters	 totals;
+};
+
+/*
+ * History file: FIST_HIST_MAGIC followed by the snapshots appended by each
+ * traversal.  A snapshot is a header (FIST_HIST_SNAPMAGIC, little-endian
+ * time, number of records and their total length, as 64, 32 and 32 bits
+ * integers) followed by the records: kind ('u', 'g' or 'p') and UID/GID
+ * (or project name length) as 32 bits integers, then the number of files,
+ * of objects, bytes and KiB allocated as 64 bits integers (and the project
+ * name), and a trailer: the records length again and a checksum (FNV-1a)
+ * of the header and records (32 bits).
+ * A snapshot torn by a crash or a full filesystem is detected by its
+ * trailer, readers skip it up to the next FIST_HIST_SNAPMAGIC.
+ */
+struct history {
+	time_t		 time;
+	int		 fd;		/* O_APPEND */
+	int		 empty;		/* new file */
+	struct owners	 users;
+	struct owners	 groups;
+	struct counters	*projects;
+};
+
+/* A record read by --trend */
+struct hrec {
+	int		 kind;
+	uint32_t	 id;
+	char		*name;		/* project */
+	uint64_t	 v[4];		/* see hrec_names */
+};
+
+/* Owner index of a dump, see index_close() */
+struct index_id {
+	uint32_t	 id;
+	int		 kind;		/* 'u' or 'g', 0: free */
+	uint64_t	 nobjs;
+	uint64_t	*runs;		/* first block and count pairs */
+	size_t		 nruns;
+	size_t		 runs_size;
+};
+
+struct index {
+	uint64_t	 block;		/* records per block */
+	uint64_t	 nrecs;
+	uint64_t	*offsets;	/* of the blocks */
+	size_t		 noffsets;
+	size_t		 offsets_size;
+	struct index_id	*tab;		/* open addressing hash table */
+	size_t		 size;		/* power of 2 */
+	size_t		 count;
+};
+
+#define FIST_IDX_MAGIC		"FISTIDX1"
+#define FIST_IDX_HDRLEN		40
+#define FIST_IDX_ENTLEN		32
+
+#define FIST_HIST_MAGIC		"FISTHIS2"
+#define FIST_HIST_SNAPMAGIC	"HSNP"
+#define FIST_HIST_SNAPLEN	20
+#define FIST_HIST_TRAILERLEN	8
+#define FIST_HIST_RECLEN	40
+
+/*
+ * Two-phase scan: the namespace is enumerated (--enumerate) with directory
+ * reads only into a list, the objects of the list are lstat'ed later
+ * (--stat-list), directory by directory and in inode order.
+ * List file: FIST_LIST_MAGIC, then a block per directory, depth first
+ * (little-endian):
+ *  - the directory: 'D', depth (32 bits, 0 for the root), name length (16
+ *    bits) and name (the full name for the root);
+ *  - its entries: 'E', inode number (64 bits), directory flag (8 bits, 1
+ *    for a directory), name length (16 bits) and name;
+ *  - the blocks of its sub-directories.
+ */
+#define FIST_LIST_MAGIC		"FISTLST2"
+#define FIST_LIST_DLEN		7	/* without the name */
+#define FIST_LIST_ELEN		12
+#define FIST_LIST_BUFSIZE	(1024 * 1024)
+
+/* A directory of the path to the current one, in --stat-list */
+struct list_level {
+	struct dnode		*dir;
+	int			 fd;		/* -1 if not opened */
+};
+
+/*
+ * Partitioned outputs: one text dump per UID (or GID), "dir/ID.fist".
+ * At most "maxfiles" files are open at once (the least recently used is
+ * closed, and reopened for appending when needed), each with its own
+ * buffer.
+ */
+struct part {
+	uint32_t	 id;
+	int		 created;	/* by this run */
+	FILE		*fp;		/* NULL when closed */
+	char		*buf;
+	struct part	*prev;		/* LRU list of open files */
+	struct part	*next;
+};
+
+struct parts {
+	int		 bygid;
+	size_t		 size;		/* power of 2 */
+	size_t		 count;
+	struct part	**tab;
+	size_t		 nopen;
+	struct part	*head;		/* most recently used */
+	struct part	*tail;
+	uint64_t	 reopens;
+};
+
+#define PART_BUFSIZE		(32 * 1024)
+#define PART_MAXFILES		256
+
+/*
+ * UID/GID to name cache (unknown IDs are cached too, with a NULL name), so
+ * that each ID is resolved only once.  When the lookup fails (I/O, NSS
+ * service errors...), it is tried again the next times the ID is seen, up
+ * to IDCACHE_TRIES times.  Only used by the output thread.
+ */
+#define IDCACHE_TRIES		3
+
+struct idname {
+	uint32_t	 id;
+	int		 kind;		/* 'u' or 'g', 0: free */
+	char		*name;		/* NULL: unknown */
+	int		 failures;	/* failed lookups, 0 once resolved */
+};
+
+struct idcache {
+	size_t		 size;		/* power of 2 */
+	size_t		 count;
+	struct idname	*tab;
+	uint64_t	 lookups;	/* NSS lookups */
+};
+
+/*
+ * Per (lower-cased) file name suffix and UID counters, in a bounded hash
+ * table: once EXT_MAX_KEYS (or less, within the memory budget) are used,
+ * files with a new suffix/UID pair are counted in a single "other" entry.
+ */
+#define EXT_MAXLEN	15
+#define EXT_MAX_KEYS	65536
+#define EXT_MIN_KEYS	1024
+
+struct ext {
+	char		 ext[EXT_MAXLEN + 1];
+	uint32_t	 uid;
+	int		 used;
+	uint64_t	 nfiles;
+	uint64_t	 bytes;
+	uint64_t	 kib;
+	time_t		 oldest;	/* mtime */
+	time_t		 newest;
+	time_t		 latime;
+};
+
+struct exts {
+	size_t		 count;
+	size_t		 max;		/* keys, power of 2 */
+	struct ext	*tab;		/* 2 * max */
+	struct ext	 other;
+};
+
+/*
+ * Projects are attributed by directory prefix: the roots of the projects
+ * are compiled into a trie of path components, the traversal follows it
+ * while descending, so that there is no per object lookup.
+ */
+struct pnode {
+	char		*name;		/* path component */
+	int		 project;	/* project rooted here or -1 */
+	size_t		 nchildren;
+	struct pnode	*children;	/* sorted by name */
+};
+
+/*
+ * Arena allocator: memory is allocated from chunks and released at once
+ * back to a "mark".  Each thread has its own arena, where the entries of a
+ * batch are allocated, so releasing a batch costs nothing and no malloc(3)
+ * or free(3) is done per directory entry.
+ * Released chunks are kept for reuse.
+ */
+struct arena_chunk {
+	struct arena_chunk	*prev;
+	size_t			 size;		/* of the data */
+	size_t			 used;
+};
+
+#define ARENA_CACHELINE		64
+
+/* Per thread, a cache line each (see pool_start()) to avoid false sharing */
+struct arena {
+	struct arena_chunk	*cur;
+	struct arena_chunk	*spare;		/* released chunks */
+	size_t			 inuse;		/* bytes allocated */
+	size_t			 peak;
+	size_t			 reserved;	/* bytes in chunks */
+	size_t			 peak_reserved;
+	char			 pad[ARENA_CACHELINE - 2
+				    * sizeof(struct arena_chunk *)
+				    - 4 * sizeof(size_t)];
+};
+
+struct arena_mark {
+	struct arena_chunk	*chunk;
+	size_t			 used;
+	size_t			 inuse;
+};
+
+#define ARENA_ALIGN(n)		(((n) + 15) & ~(size_t) 15)
+#define ARENA_CHUNK_HDR		ARENA_ALIGN(sizeof(struct arena_chunk))
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+
+/*
+ * A directory entry: directories are read in batches of entries which are
+ * lstat'ed concurrently before being output in order.
+ */
+struct dent {
+	char		*name;
+	char		*lname;		/* symlink value or NULL */
+	ino_t		 ino;		/* from the directory entry */
+	int		 isdir;		/* -1: unknown yet */
+	int		 need_st;	/* has to be lstat'ed */
+	int		 has_st;	/* "st" is valid */
+	FIST_SSTAT	 st;
+};
+
+/*
+ * ext4 image scan: the in use inodes (sorted by number), directories,
+ * directory entries and directory/symlink blocks to read.
+ */
+struct ext4_inode {
+	uint32_t	 ino;
+	uint32_t	 dir;		/* directory number + 1, 0 if not */
+	uint32_t	 mode;
+	uint32_t	 nlink;
+	uint32_t	 uid;
+	uint32_t	 gid;
+	uint64_t	 size;
+	uint64_t	 blocks;	/* 512 bytes blocks */
+	int64_t		 atime;
+	int64_t		 mtime;
+	int64_t		 ctime;
+	char		*lname;		/* symlink value */
+};
+
+struct ext4_dir {
+	uint32_t	 inode;		/* index in inodes */
+	int		 seen;
+	size_t		 first;		/* entries (in dents) */
+	size_t		 count;
+};
+
+struct ext4_dent {
+	uint32_t	 dir;		/* index in dirs */
+	uint32_t	 ino;
+	uint64_t	 pos;		/* logical block and offset */
+	const char	*name;
+};
+
+struct ext4_blk {
+	uint64_t	 pblk;
+	uint32_t	 inode;		/* index in inodes */
+	uint32_t	 lblk;
+};
+
+struct ext4_fs {
+	const char		*image;
+	int			 fd;
+	uint32_t		 bsize;
+	uint32_t		 ipg;		/* inodes per group */
+	uint32_t		 isize;
+	uint32_t		 descsize;
+	uint32_t		 incompat;
+	uint32_t		 rocompat;
+	uint64_t		 nblocks;
+	uint64_t		 ngroups;
+	uint64_t		 bytes_read;
+	unsigned char		*gdt;		/* group descriptors */
+	struct ext4_inode	*inodes;
+	size_t			 ninodes, inodes_size;
+	struct ext4_dir		*dirs;
+	size_t			 ndirs, dirs_size;
+	struct ext4_dent	*dents;
+	size_t			 ndents, dents_size;
+	struct ext4_blk		*blks;
+	size_t			 nblks, blks_size;
+	struct arena		 arena;		/* names, symlinks values */
+};
+
+#define EXT4_MAGIC				0xEF53
+#define EXT4_EXT_MAGIC				0xF30A
+#define EXT4_ROOT_INO				2
+#define EXT4_READ_SIZE				(1024 * 1024)
+#define EXT4_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT		0x0080
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE	0x0008
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM		0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM	0x0400
+#define EXT4_BG_INODE_UNINIT			0x0001
+#define EXT4_HUGE_FILE_FL			0x00040000
+#define EXT4_EXTENTS_FL				0x00080000
+#define EXT4_INLINE_DATA_FL			0x10000000
+
+#define STAT_PER_THREAD		8	/* minimum entries per pool thread */
+
+/*
+ * Metadata requests (lstat/readlink) of a batch are issued concurrently by
+ * the walker and a pool of threads.  The number of threads used (i.e. of
+ * requests in flight) is set by the concurrency controller.
+ */
+struct pool {
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 work;		/* a batch is available */
+	pthread_cond_t	 done;		/* the batch is complete */
+	pthread_t	*threads;
+	struct arena	*arenas;	/* per thread, "0" is the walker */
+	unsigned	 nthreads;	/* including the walker */
+	unsigned	 generation;	/* batch number */
+	unsigned	 participants;	/* threads used for this batch */
+	unsigned	 busy;		/* pool threads still working */
+	int		 quit;
+	struct dent	*ents;
+	size_t		 nents;
+	size_t		*order;		/* lstat order, NULL: in order */
+	atomic_size_t	 next;		/* next entry to process */
+	int		 dfd;
+	const char	*parent;
+	uint64_t	 ops;		/* requests issued for this batch */
+	uint64_t	 lat_ns;	/* and their total latency */
+};
+
+/*
+ * Gradient-style concurrency controller: the limit grows while the latency
+ * of the requests stays close to the lowest observed latency, and shrinks
+ * in proportion when it increases (the requests are queued somewhere).
+ * When the throughput drops after an increase, the limit is decreased
+ * multiplicatively.  The limit should thus sit at the throughput "knee".
+ */
+struct controller {
+	double		 limit;
+	unsigned	 max;
+	uint64_t	 win_ops;	/* current measurement window */
+	uint64_t	 win_lat_ns;
+	uint64_t	 win_wall_ns;
+	double		 min_lat;	/* lowest average latency (ns) */
+	double		 prev_tput;	/* previous window throughput */
+	double		 prev_limit;
+	unsigned	 windows;
+	uint64_t	 total_ops;	/* statistics */
+	double		 sum_limit;
+};
+
+#define CTL_WINDOW_NS		50000000ULL	/* 50 ms */
+#define CTL_WINDOW_OPS		64
+#define CTL_REPROBE		64	/* windows before forgetting min_lat */
+#define JOBS_DEFAULT		32
+#define JOBS_PER_CPU		8	/* default jobs, per usable CPU */
+#define CPU_MAX			1024
+
+/*
+ * Filesystem profiles: traversal defaults per filesystem type (statfs(2)
+ * "f_type" of the directory), overridable with --fs-profile.
+ *  - jobs: metadata requests concurrency, per usable CPU and at most;
+ *  - batch: entries read before being lstat'ed (more concurrency);
+ *  - bufsize: default outputs buffer size;
+ *  - order: lstat order of a batch, by inode number is faster on disks
+ *    (inode tables are read sequentially), readdir order keeps attributes
+ *    prefetched by the server (e.g. NFS READDIRPLUS) in its caches;
+ *  - dtype: object types in directory entries are reliable;
+ *  - leaf: directories link count is 2 plus their number of
+ *    sub-directories (not on btrfs where it is always 1, nor on network
+ *    filesystems where it depends on the server).
+ */
+struct fs_profile {
+	const char	*name;
+	long		 magic;		/* 0: only by name */
+	unsigned	 jobs_per_cpu;
+	unsigned	 jobs_max;
+	size_t		 batch;
+	size_t		 bufsize;
+	int		 order;		/* ORDER_* */
+	int		 dtype;
+	int		 leaf;
+};
+
+#define ORDER_READDIR		0
+#define ORDER_INODE		1
+#define ORDER_INODE_HDD		2	/* on rotational disks only */
+
+#ifndef NFS_SUPER_MAGIC
+# define NFS_SUPER_MAGIC	0x6969
+#endif
+#ifndef BTRFS_SUPER_MAGIC
+# define BTRFS_SUPER_MAGIC	0x9123683E
+#endif
+#define LUSTRE_SUPER_MAGIC	0x0BD00BD0
+#define GPFS_SUPER_MAGIC	0x47504653
+#ifndef CEPH_SUPER_MAGIC
+# define CEPH_SUPER_MAGIC	0x00C36400
+#endif
+#ifndef FUSE_SUPER_MAGIC
+# define FUSE_SUPER_MAGIC	0x65735546
+#endif
+
+/*
+ * A directory to traverse: only its own name and a (reference counted)
+ * pointer to its parent are kept, full names are built only when needed
+ * (dnode_path()), so pending directories cost the length of their names
+ * not of their full names.
+ */
+struct dnode {
+	struct dnode		*parent;	/* NULL for the root */
+	atomic_uint		 refs;
+	const struct pnode	*pn;		/* projects trie node */
+	int			 project;	/* project of its objects */
+	size_t			 len;
+	char			 name[];	/* full name for the root */
+};
+
+/*
+ * The walker hands objects to the output thread (which formats and writes
+ * them) through a bounded single producer, single consumer, lock-free
+ * queue, so that the traversal goes on while the outputs are written and
+ * vice versa.
+ * The queue is a ring of variable size records (the names follow the
+ * record header), a record never wraps around the end of the ring.
+ */
+struct qrec {
+	size_t		 len;		/* of the record, with the names */
+	int		 type;
+	int		 has_st;
+	int		 project;
+	struct dnode	*dir;		/* holds a reference, NULL: root */
+	size_t		 namelen;
+	size_t		 lnamelen;	/* (size_t) -1: no symlink value */
+	FIST_SSTAT	 st;
+};
+
+#define QREC_OBJ		0
+#define QREC_SKIP		1	/* end of the ring is not used */
+#define QREC_END		2	/* end of the traversal */
+
+struct queue {
+	char		*ring;
+	size_t		 size;		/* power of 2 */
+	atomic_size_t	 head;		/* written by the producer */
+	char		 pad1[64];
+	atomic_size_t	 tail;		/* written by the consumer */
+	char		 pad2[64];
+	uint64_t	 full_waits;	/* statistics */
+	uint64_t	 empty_waits;
+};
+
+#define QUEUE_SIZE		(4 * 1024 * 1024)
+
+/*
+ * Trace (--trace): spans of the scan activity (directories, their opening,
+ * entries reading, lstat batches, output queue draining...) recorded with
+ * their thread in a ring of fixed size events (the oldest are overwritten
+ * when it's full) and written at the end in the Chrome trace-event JSON
+ * format, for trace viewers.
+ */
+#define TRACE_NAMELEN		41	/* events are 64 bytes */
+#define TRACE_EVENTS		(256 * 1024)
+
+#define TRACE_DIR		0	/* whole directory, with the subdirs */
+#define TRACE_OPEN		1	/* sub-directory opening */
+#define TRACE_READDIR		2	/* entries batch reading */
+#define TRACE_STAT		3	/* lstat batch (waiting for threads) */
+#define TRACE_LSTAT		4	/* part of a lstat batch of a thread */
+#define TRACE_QFULL		5	/* output queue full */
+#define TRACE_OUTPUT		6	/* output queue draining */
+#define TRACE_FLUSH		7	/* output closing */
+
+struct trace_ev {
+	uint64_t	 start;		/* ns, since the start */
+	uint64_t	 dur;		/* ns */
+	uint32_t	 count;		/* entries, objects */
+	uint16_t	 tid;		/* 0: walker, 1: output, N + 1: pool */
+	uint8_t		 kind;
+	char		 name[TRACE_NAMELEN];	/* end of the full name */
+};
+
+struct trace {
+	struct trace_ev	*ring;		/* NULL: no trace */
+	size_t		 size;
+	atomic_size_t	 next;
+	uint64_t	 t0;
+	const char	*path;
+};
+
+#define TRACE_NOW()		(trace.ring != NULL ? now_ns() : 0)
+
+/*
+ * Memory budget (--max-memory): the scan time data structures (arenas,
+ * directories, output queue and buffers, aggregation tables, trace) are
+ * accounted for, those which can be smaller are reduced when the budget
+ * is exhausted instead of failing: output queue, buffers and trace ring
+ * allocated smaller, "byuid"/"bygid" files closed (and their buffers
+ * written) earlier, fewer "ext" keys, spare arena chunks freed and a
+ * single metadata request at a time.
+ */
+struct budget {
+	size_t		 limit;		/* 0: no limit */
+	atomic_size_t	 used;
+	atomic_size_t	 peak;
+	atomic_uint	 degraded;	/* BUDGET_* */
+};
+
+#define BUDGET_QUEUE		0x01
+#define BUDGET_BUFFERS		0x02
+#define BUDGET_FILES		0x04
+#define BUDGET_EXT		0x08
+#define BUDGET_ARENAS		0x10
+#define BUDGET_JOBS		0x20
+#define BUDGET_TRACE		0x40
+
+#define BUDGET_MINBUF		(4 * 1024)
+#define QUEUE_MIN		(64 * 1024)
+#define TRACE_MIN		1024
+
+/*
+ * Work distribution between processes (--spool): the directories to
+ * traverse are "tickets" (files with the full name of a directory) in a
+ * spool directory shared by the processes, on one or several hosts.
+ * A ticket is written in "tmp" and renamed in "todo", it is claimed by
+ * renaming it in "claimed" (only one process can) and removed once its
+ * directory is traversed. Sub-directories are pushed back as tickets when
+ * few are waiting, before the ticket of their parent is removed, so the
+ * scan is complete when "todo" and "claimed" are both empty.
+ * A claimed ticket is named after its claimant ("ticket@host.pid") and its
+ * modification time is a lease, renewed while its directory is traversed:
+ * the tickets of a claimant which died (on the same host) or whose lease
+ * expired are put back in "todo" by the idle processes.
+ * The first process to create "seed" pushes the root, then writes to it.
+ */
+struct spool {
+	const char	*dir;		/* NULL: no spool */
+	char		 host[64];
+	char		 id[128];	/* "host.pid", ticket names prefix */
+	uint64_t	 seq;
+	char		*ticket;	/* claimed ticket name */
+	uint64_t	 renewed;	/* its lease */
+	size_t		 waiting;	/* tickets in "todo" (estimate) */
+	uint64_t	 checked;	/* when they were counted */
+	uint64_t	 claims;	/* statistics */
+	uint64_t	 pushes;
+};
+
+#define SPOOL_LOW		16	/* tickets waiting, push below */
+#define SPOOL_CHECK_NS		1000000000ULL
+#define SPOOL_POLL_NS		200000000L
+#define SPOOL_LEASE		300	/* seconds, claimed tickets lease */
+#define QREC_ALIGN(n)		(((n) + 15) & ~(size_t) 15)
+
+#define SINK_BUFSIZE		(256 * 1024)
+
 #ifndef HAS_STRLCPY
 size_t strlcpy(char *, const char *, size_t);
 #endif
@@ -85,244 +818,5703 @@ void error(const int, const int, const char *, ...);
 void warning(const int, const char *, ...);
 static void verror(const int, const char *, va_list);
 
-void print_metadata(FILE *, const char *, const char *,
+static void usage(void);
+static void *grow(void *, size_t *, const size_t, const size_t);
+
+void print_metadata(FILE *, const struct fist_obj *);
+void print_name(FILE *, const char *, const char *);
+static const char *read_link(const int, const char *, const char *,
+	char *);
+int dir_lookup(const dev_t, const int, struct dnode *);
+static struct dnode *dnode_new(struct dnode *, const char *,
+	const struct pnode *, const int);
+static void dnode_unref(struct dnode *);
+static char *dnode_path(const struct dnode *, struct arena *);
+static int open_subdir(const int, const char *, const dev_t,
 	const FIST_SSTAT *);
-int dir_lookup(const dev_t, const char *, const char *);
+static void fs_profile_select(const char *);
+static int is_rotational(const dev_t);
+static void stat_order(struct dent *, const size_t, struct arena *);
+static int dent_ino_cmp(const void *, const void *);
+static void pool_start(const unsigned);
+static void parse_cpulist(const char *);
+static void pin_thread(const unsigned);
+static unsigned available_cpus(void);
+static unsigned cgroup_quota(const char *, const int);
+static void pool_stop(void);
+static void *pool_thread(void *);
+static void pool_run(const unsigned);
+#ifdef FIST_EMBEDDED
+static void pool_try(const unsigned);
+static void output_drop(void);
+static void walk_push(const int);
+static void walk_close(void);
+#endif /* FIST_EMBEDDED */
+static struct arena_mark *pool_mark(void);
+static void pool_release(struct arena_mark *);
+static void *arena_alloc(struct arena *, const size_t);
+static char *arena_strdup(struct arena *, const char *);
+static struct arena_mark arena_mark(const struct arena *);
+static void arena_release(struct arena *, const struct arena_mark *);
+static void arena_free(struct arena *);
+static void stat_batch(struct dent *, const size_t, const int,
+	const char *);
+static void controller_update(const uint64_t, const uint64_t,
+	const uint64_t);
+static uint64_t now_ns(void);
+static void trace_init(const char *);
+static void trace_span(const int, const unsigned, const uint64_t,
+	const size_t, const char *, const char *);
+static void trace_write(void);
+static void trace_start(void);
+static int budget_take(const size_t, const int);
+static void budget_give(const size_t);
+static int budget_over(void);
+static size_t budget_fit(const size_t, const size_t, const unsigned);
+static void budget_report(void);
+static int spool_seed(const char *);
+static int spool_push(const char *, const char *);
+static int spool_hungry(void);
+static char *spool_claim(void);
+static size_t spool_count(const char *);
+static void spool_renew(void);
+static void spool_recover(void);
+static int spool_run(const char *, const int, const dev_t);
+static int open_beneath(const int, const dev_t, const char *,
+	const char *);
+static int list_write(const char *, const char *);
+static int list_dir(FILE *, const dev_t, const int, const uint32_t,
+    const char *, const char *, struct arena *, uint64_t *);
+static char *list_load(const char *);
+static int list_stat(const dev_t, const int, struct dnode *);
+static int list_batch(const struct list_level *, struct dent *,
+    const size_t);
+static void list_close(struct list_level *);
+static void list_get(void *, const size_t);
+static int list_dent_cmp(const void *, const void *);
 
 int print_percent_encoded_char(const char, FILE*);
 
-int
-main(int argc, char *argv[])
-{
-	FIST_SSTAT st;
+static void add_sink(const char *);
+static uint64_t parse_number(const char *, const char *);
+static int filter_match(const struct filter *, const struct fist_obj *);
+static void output(struct dnode *, const char *, const FIST_SSTAT *,
+	const char *, const int);
+static void *output_thread(void *);
+static struct qrec *queue_reserve(const size_t);
+static void queue_wait(unsigned *);
+static void close_sinks(void);
+static void sink_stream_open(struct sink *);
+static void sink_stream_close(struct sink *);
+static void text_emit(struct sink *, const struct fist_obj *);
+static void bin_open(struct sink *);
+static void bin_emit(struct sink *, const struct fist_obj *);
+static void owners_open(struct sink *);
+static struct owner *owner_lookup(struct owners *, const uint32_t);
+static void owners_emit(struct sink *, const struct fist_obj *);
+static void owners_close(struct sink *);
+static void counters_add(struct counters *, const FIST_SSTAT *);
+static void print_counters_json(FILE *, const struct counters *,
+	const char *);
+static int owner_cmp(const void *, const void *);
+static void projects_open(struct sink *);
+static void projects_emit(struct sink *, const struct fist_obj *);
+static void projects_close(struct sink *);
+static void exts_open(struct sink *);
+static void exts_emit(struct sink *, const struct fist_obj *);
+static void exts_close(struct sink *);
+static int ext_cmp(const void *, const void *);
+static void parts_open(struct sink *);
+static void parts_emit(struct sink *, const struct fist_obj *);
+static void parts_close(struct sink *);
+static void part_close(struct sink *, struct part *);
+static void ids_emit(struct sink *, const struct fist_obj *);
+static void ids_close(struct sink *);
+static struct idname *idcache_lookup(const int, const uint32_t);
+static int idname_cmp(const void *, const void *);
+static void print_json_string(FILE *, const char *);
+static size_t utf8_len(const unsigned char *);
+static void history_open(struct sink *);
+static void history_emit(struct sink *, const struct fist_obj *);
+static void history_close(struct sink *);
+static void history_record(unsigned char *, const int, const uint32_t,
+	const struct counters *);
+static int history_trend(const char *);
+static int history_read(FILE *, const char *, const time_t, const time_t,
+	unsigned char *, unsigned char **, size_t *);
+static uint32_t history_sum(const unsigned char *, const unsigned char *,
+	const size_t);
+static struct hrec *history_parse(const unsigned char *, const size_t,
+	const size_t, uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+static void history_free(struct hrec *, const size_t);
+static int hrec_cmp(const void *, const void *);
+static void index_open(struct sink *);
+static void index_add(struct sink *, const struct fist_obj *);
+static struct index_id *index_lookup(struct index *, const int,
+	const uint32_t);
+static void index_close(struct sink *);
+static int index_id_cmp(const void *, const void *);
+static unsigned char *leb128_put(unsigned char *, uint64_t);
+static int leb128_get(const unsigned char **, const unsigned char *,
+	uint64_t *);
+static int index_lookup_dump(const char *);
+static int index_runs(const unsigned char *, const size_t, const uint64_t,
+	const uint64_t, const int, const uint32_t, unsigned char *, const int);
+static void text_owner(const unsigned char *, const unsigned char *,
+	uint64_t *, uint64_t *);
+static unsigned char *read_file(const char *, size_t *);
+static int ext4_scan(const char *, const char *, const struct pnode *,
+	const int);
+static void ext4_read(struct ext4_fs *, void *, const size_t,
+	const uint64_t);
+static void ext4_itable(struct ext4_fs *, const uint64_t);
+static void ext4_inode_parse(const struct ext4_fs *, struct ext4_inode *,
+	const unsigned char *, const uint32_t);
+static void ext4_map(struct ext4_fs *, const unsigned char *, const uint32_t,
+	const size_t, const uint64_t);
+static void ext4_extents(struct ext4_fs *, const unsigned char *,
+	const size_t, const uint64_t, const int);
+static void ext4_indirect(struct ext4_fs *, const uint32_t, const int,
+	const size_t, uint64_t *, const uint64_t);
+static void ext4_blk_add(struct ext4_fs *, const uint64_t, const size_t,
+	const uint64_t);
+static void ext4_blocks(struct ext4_fs *);
+static void ext4_dirblock(struct ext4_fs *, const unsigned char *,
+	const size_t, const size_t, const uint32_t);
+static int ext4_tree(struct ext4_fs *, struct dnode *, const size_t);
+static struct ext4_inode *ext4_inode_find(const struct ext4_fs *,
+	const uint32_t);
+static void ext4_stat(const struct ext4_inode *, FIST_SSTAT *);
+static int ext4_blk_cmp(const void *, const void *);
+static int ext4_dent_cmp(const void *, const void *);
 
-	if (argc != 2) {
-		fprintf(stderr, "Absolute directory name or \".\" argument required\n");
-		exit(1);
-	}
+static void load_projects(const char *);
+static struct pnode *pnode_child(const struct pnode *, const char *,
+	const int);
+static const struct pnode *pnode_root(const char *, int *, const int);
 
-	if (chdir(argv[1]) == -1)
-		error(1, errno, "Unable to change directory to '%s'", argv[1]);
+static const struct sink_type sink_types[] = {
+	{ "text",	1, SINK_BUFSIZE, sink_stream_open,	text_emit,
+	    sink_stream_close },
+	{ "bin",	0, SINK_BUFSIZE, bin_open,		bin_emit,
+	    sink_stream_close },
+	{ "users",	0, SINK_BUFSIZE, owners_open,		owners_emit,
+	    owners_close },
+	{ "groups",	0, SINK_BUFSIZE, owners_open,		owners_emit,
+	    owners_close },
+	{ "projects",	0, SINK_BUFSIZE, projects_open,		projects_emit,
+	    projects_close },
+	{ "ext",	0, SINK_BUFSIZE, exts_open,		exts_emit,
+	    exts_close },
+	{ "byuid",	0, PART_BUFSIZE, parts_open,		parts_emit,
+	    parts_close },
+	{ "bygid",	0, PART_BUFSIZE, parts_open,		parts_emit,
+	    parts_close },
+	{ "ids",	0, SINK_BUFSIZE, sink_stream_open,	ids_emit,
+	    ids_close },
+	{ "history",	0, 0,		 history_open,		history_emit,
+	    history_close },
+	{ NULL,		0, 0,		 NULL,			NULL,
+	    NULL }
+};
 
-	if (FIST_LSTAT(argv[1], &st) == -1)
-		error(1, errno, "Unable to lstat(2) '%s'", argv[1]);
+/* Outputs, in command line order */
+static struct sink	*sinks = NULL;
 
-	print_metadata(stdout, argv[1], NULL, &st);
+/* Projects roots trie and names */
+static struct pnode	 ptrie = { NULL, -1, 0, NULL };
+static char		**pnames = NULL;
+static size_t		 nprojects = 0;
 
-	if (dir_lookup(st.st_dev, argv[1], argv[1]))
-		warning(-1, "A problem occurred while traversing '%s'",
-		    argv[1]);
+/* Effective UID, to know when O_NOATIME is allowed */
+static uid_t	euid;
 
-	return (0);
-}
+/* Only print names (no lstat(2) unless required to find directories) */
+static int	names_only = 0;
+/* Directories link count can be used to find "leaf" directories */
+static int	use_leaf = 1;
+/* Print statistics at the end */
+static int	verbose = 0;
+/* CPUs to pin the threads to (-C) */
+static unsigned	*cpus = NULL;
+static unsigned	 ncpus = 0;
 
+static struct pool		pool;
+static struct controller	ctl;
+static struct queue		queue;
+static struct idcache		idcache;
+static struct trace		trace;
+static struct budget		budget;
+static struct spool		spool;
 
+/* --stat-list list, read a directory block at a time */
+static struct {
+	const char		*path;
+	FILE			*fp;
+	char			*buf;
+	size_t			 bufsize;
+} list;
+
+#ifdef FIST_EMBEDDED
 /*
- * Simple recursive depth-first directory traversal.
+ * Embedded, error() does not exit but jumps to "error_jmp" of its thread:
+ * the program sets the walker's, the pool and output threads set theirs
+ * (see pool_try() and output_thread()).  The first error is kept for
+ * the program, the walker fails in turn after a batch if another thread
+ * failed.
+ */
+static _Thread_local jmp_buf	*error_jmp = NULL;
+static atomic_int		 error_raised;
+static int			 error_errnum;
+static char			 error_msg[256];
+
+/*
+ * The directories being traversed by the walker, closed after an error
+ * with the sub-directories being looked into (the callers' references).
+ */
+static struct {
+	struct walk_dir {
+		int		 fd;
+		DIR		*dirp;		/* NULL until opened */
+		struct dnode	*sub;		/* NULL between lookups */
+	}			*dirs;
+	size_t			 n;
+	size_t			 size;
+} walk;
+#endif /* FIST_EMBEDDED */
+
+static const char	*trace_names[] = { "dir", "open", "readdir", "stat",
+	"lstat", "queue full", "output", "flush" };
+static const struct fs_profile	fs_profiles[] = {
+	{ "ext4",	EXT4_SUPER_MAGIC,	8, 32,	4096,	256 * 1024,
+	    ORDER_INODE_HDD,	1, 1 },
+	{ "xfs",	XFS_SUPER_MAGIC,	8, 32,	4096,	256 * 1024,
+	    ORDER_INODE_HDD,	1, 1 },
+	{ "reiserfs",	REISERFS_SUPER_MAGIC,	8, 32,	4096,	256 * 1024,
+	    ORDER_INODE_HDD,	1, 1 },
+	{ "btrfs",	BTRFS_SUPER_MAGIC,	8, 32,	4096,	256 * 1024,
+	    ORDER_READDIR,	1, 0 },
+	{ "tmpfs",	TMPFS_MAGIC,		1, 32,	4096,	256 * 1024,
+	    ORDER_READDIR,	1, 1 },
+	{ "nfs",	NFS_SUPER_MAGIC,	32, 128, 16384,	1024 * 1024,
+	    ORDER_READDIR,	1, 0 },
+	{ "lustre",	LUSTRE_SUPER_MAGIC,	32, 128, 16384,	1024 * 1024,
+	    ORDER_READDIR,	1, 0 },
+	{ "gpfs",	GPFS_SUPER_MAGIC,	32, 128, 16384,	1024 * 1024,
+	    ORDER_READDIR,	1, 0 },
+	{ "cephfs",	CEPH_SUPER_MAGIC,	32, 128, 16384,	1024 * 1024,
+	    ORDER_READDIR,	1, 0 },
+	{ "fuse",	FUSE_SUPER_MAGIC,	8, 32,	4096,	256 * 1024,
+	    ORDER_READDIR,	1, 0 },
+#ifdef FIST_SIMFS
+	{ "simfs",	0,			32, 128, 16384,	1024 * 1024,
+	    ORDER_READDIR,	1, 1 },
+#endif /* FIST_SIMFS */
+	{ "default",	0,	JOBS_PER_CPU, JOBS_DEFAULT, 4096, SINK_BUFSIZE,
+	    ORDER_READDIR,	1, 0 },
+	{ NULL,		0,	0, 0,	0,	0,	0,	0, 0 }
+};
+
+static const char	*order_names[] = { "readdir", "inode", "inode" };
+
+/* Profile of the traversed filesystem */
+static struct fs_profile	 profile;
+static const char		*profile_arg = NULL;
+
+static const char	*budget_names[] = { "output queue", "output buffers",
+	"open files", "ext keys", "spare arena chunks", "concurrency",
+	"trace ring" };
+
+static const char	*hrec_names[] = { "nfiles", "nobjects", "bytes", "kib" };
+
+static const struct option longopts[] = {
+	{ "cpus",	required_argument, NULL, 'C' },
+	{ "names-only",	no_argument,	NULL,	'n' },
+	{ "noleaf",	no_argument,	NULL,	'L' },
+	{ "jobs",	required_argument, NULL, 'j' },
+	{ "output",	required_argument, NULL, 'o' },
+	{ "projects",	required_argument, NULL, 'p' },
+	{ "trend",	required_argument, NULL, 'T' },
+	{ "ext4-image",	required_argument, NULL, 'E' },
+	{ "lookup",	required_argument, NULL, 'K' },
+	{ "trace",	required_argument, NULL, 'R' },
+	{ "max-memory",	required_argument, NULL, 'M' },
+	{ "fs-profile",	required_argument, NULL, 'P' },
+	{ "spool",	required_argument, NULL, 'S' },
+	{ "enumerate",	required_argument, NULL, 'N' },
+	{ "stat-list",	required_argument, NULL, 'Q' },
+	{ "verbose",	no_argument,	NULL,	'v' },
+	{ NULL,		0,		NULL,	0 }
+};
+
+/*
+ * Built into another program (the Python module, see python/fistscan.c),
+ * which drives the scan itself: the command is then "fist_main()".
  */
+#ifdef FIST_EMBEDDED
+# define main	fist_main
+int main(int, char *[]);
+#endif /* FIST_EMBEDDED */
+
 int
-dir_lookup(const dev_t dev, const char *thisdir, const char *parent)
+main(int argc, char *argv[])
 {
-	char		 pwd[PATH_MAX];
-	FIST_SSTAT	 st;
-	DIR		*dirp = NULL;
-	struct dirent	*dp = NULL;
-	int		 r = 0;
+	char			 lnvalue[PATH_MAX];
+	FIST_SSTAT		 st;
+	struct sink		*s = NULL;
+	const struct pnode	*pn = NULL;
+	struct dnode		*root = NULL;
+	struct qrec		*q = NULL;
+	pthread_t		 outthr;
+	unsigned		 jobs = 0, i;
+	size_t			 inuse, reserved;
+	const char		*trend = NULL, *image = NULL, *lookup = NULL;
+	const char		*enumerate = NULL, *statlist = NULL;
+	char			*lroot = NULL;
+	int			 fd = -1, ch, project = -1;
 
-	if ((dirp = opendir(thisdir)) == NULL) {
-		warning(errno, "Unable to open directory '%s'", parent);
-		return (-1);
+	while ((ch = getopt_long(argc, argv, "C:j:no:p:v", longopts, NULL))
+	    != -1) {
+		switch (ch) {
+		case 'C':
+			parse_cpulist(optarg);
+			break;
+		case 'n':
+			names_only = 1;
+			break;
+		case 'L':
+			use_leaf = 0;
+			break;
+		case 'j':
+			if ((jobs = (unsigned) parse_number("-j", optarg)) == 0
+			    || jobs > 1024)
+				error(1, -1, "Invalid number of jobs '%s'",
+				    optarg);
+			break;
+		case 'o':
+			add_sink(optarg);
+			break;
+		case 'p':
+			load_projects(optarg);
+			break;
+		case 'T':
+			trend = optarg;
+			break;
+		case 'E':
+			image = optarg;
+			break;
+		case 'K':
+			lookup = optarg;
+			break;
+		case 'R':
+			trace_init(optarg);
+			break;
+		case 'P':
+			profile_arg = optarg;
+			break;
+		case 'S':
+			spool.dir = optarg;
+			break;
+		case 'N':
+			enumerate = optarg;
+			break;
+		case 'Q':
+			statlist = optarg;
+			break;
+		case 'M':
+			if ((budget.limit = (size_t) parse_number(
+			    "--max-memory", optarg)) == 0)
+				error(1, -1, "Invalid memory budget '%s'",
+				    optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
 	}
+	argc -= optind;
+	argv += optind;
 
-	if (chdir(thisdir) == -1) {
-		warning(errno, "Unable to change directory to '%s'", thisdir);
-		return (-1);
+	if (trend != NULL) {
+		if (argc != 0 || sinks != NULL)
+			usage();
+		return (history_trend(trend));
 	}
-
-	while ((dp = readdir(dirp)) != NULL) {
-		if (FIST_LSTAT(dp->d_name, &st) == -1) {
-			warning(errno, "Unable to lstat('%s%s%s')",
-			    parent != NULL ? parent : "",
-			    parent != NULL ? "/" : "",
-			    dp->d_name);
-			continue;
-		}
-		print_metadata(stdout, dp->d_name, parent, &st);
-		/*
-		 * If the current object is:
-		 *  - a directory,
-		 *  - not a mount point,
-		 *  - neither '.' nor '..'
-		 * then we'll try to look inside it.
-		 */
-		if (S_ISDIR(st.st_mode) && (st.st_dev == dev)
-		    && !(dp->d_name[0] == '.' && ((dp->d_name[1] == '\0')
-		        || (dp->d_name[1] == '.' && dp->d_name[2] == '\0')))) {
-			if (strlcpy(pwd, parent, PATH_MAX) >= PATH_MAX) {
-				warning(-1, "parent name too long: '%s'",
-				    parent);
-				break;
-			}
-			if (strlcat(pwd, "/", PATH_MAX) >= PATH_MAX) {
-				warning(-1, "pwd name too long: '%s'", pwd);
-				break;
-			}
-			if (strlcat(pwd, dp->d_name, PATH_MAX) >= PATH_MAX) {
-				warning(-1, "dp->d_name name too long: '%s'",
-				    dp->d_name);
-				break;
-			}
-			r = dir_lookup(dev, dp->d_name, pwd);
-		}
+	if (lookup != NULL) {
+		if (argc != 0 || sinks != NULL)
+			usage();
+		return (index_lookup_dump(lookup));
 	}
 
-	if (closedir(dirp) == -1)
-		warning(errno, "Error while closing directory '%s'", thisdir);
+	/* The directory of a list is in the list */
+	if (argc != (statlist != NULL ? 0 : 1) || ((statlist != NULL
+	    || enumerate != NULL) && (image != NULL || spool.dir != NULL))
+	    || (enumerate != NULL && (statlist != NULL || sinks != NULL)))
+		usage();
 
-	/*
-	 * We can safely chdir("..") since we do not cross mount points and
-	 * follow symlinks.  Furthermore, we already successfully changed
-	 * directory to "thisdir", so it's safe to go back to the previous
-	 * level.
-	 */
-	if (chdir("..") == -1) {
-		warning(errno, "Unable to change directory to '%s'", parent);
-		return (-1);
+	/* Before any allocation, for NUMA locality */
+	pin_thread(0);
+	if (statlist != NULL) {
+		lroot = list_load(statlist);
+		argv = &lroot;
+	}
+	fs_profile_select(image == NULL ? argv[0] : NULL);
+	if (jobs == 0) {
+		jobs = profile.jobs_per_cpu * available_cpus();
+		if (jobs > profile.jobs_max)
+			jobs = profile.jobs_max;
 	}
 
-	return (r);
-}
+	if (enumerate != NULL)
+		return (list_write(argv[0], enumerate));
 
+	if (sinks == NULL)
+		add_sink("text:-");
+	for (s = sinks; s != NULL; s = s->next) {
+		if (names_only && (!s->type->nostat || s->filter.active
+		    || s->index_block > 0))
+			error(1, -1, "Only unfiltered \"text\" outputs are "
+			    "possible with names only");
+		if (!s->bufsize_set && s->type->bufsize == SINK_BUFSIZE)
+			s->bufsize = profile.bufsize;
+		s->type->open(s);
+		if (s->index_block > 0)
+			index_open(s);
+	}
 
-void
-print_metadata(FILE *fp, const char *name, const char *parent,
-    const FIST_SSTAT *st)
-{
-	static char	 lnvalue[PATH_MAX];
-	unsigned char	*c = NULL;
-	int		 lnlen = -1;
+	euid = geteuid();
 
-	/*
-	 * Don't print '.' and '..' for the non-root directories.
-	 */
-	if (S_ISDIR(st->st_mode) && parent != NULL && (name[0] == '.'
-		&& ((name[1] == '\0') || (name[1] == '.' && name[2] == '\0'))))
-			return;
+	/* With an ext4 image, the directory is where the image is mounted */
+	pn = pnode_root(argv[0], &project, image != NULL);
+	if (image == NULL) {
+		if ((fd = FS_OPEN(argv[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+		    == -1)
+			error(1, errno, "Unable to open directory '%s'",
+			    argv[0]);
 
-	fprintf(fp, "%u:%o:%u:%u:%u:%" PRIu64 ":%u:%u:%u:",
-	    (unsigned int) ((st->st_blocks + 1) >> 1),
-	    (unsigned int) st->st_mode, (unsigned int) st->st_nlink,
-	    (unsigned int) st->st_uid, (unsigned int) st->st_gid,
-	    (uint64_t) st->st_size, (unsigned int) st->st_mtime,
-	    (unsigned int) st->st_atime, (unsigned int) st->st_ctime);
+		if (FS_LSTAT(argv[0], &st) == -1)
+			error(1, errno, "Unable to lstat(2) '%s'", argv[0]);
 
-	if (parent != NULL) {
-		for (c = (unsigned char *) parent; c != NULL && *c != '\0'; c++)
-			print_percent_encoded_char(*c, fp);
-		fputc('/', fp);
+		use_leaf = use_leaf && profile.leaf;
+
+		pool_start(jobs);
 	}
 
-	for (c = (unsigned char *) name; c != NULL && *c != '\0'; c++)
-		print_percent_encoded_char(*c, fp);
+	queue.size = budget_fit(QUEUE_SIZE, QUEUE_MIN, BUDGET_QUEUE);
+	if ((queue.ring = malloc(queue.size)) == NULL)
+		error(1, errno, "Unable to allocate output queue");
+	trace_start();
+	if ((errno = pthread_create(&outthr, NULL, output_thread, NULL)) != 0)
+		error(1, errno, "Unable to create output thread");
 
-	if (S_ISLNK(st->st_mode)) {
-		if ((lnlen = readlink(name, lnvalue,
-		    sizeof(lnvalue) - 1)) == -1) {
-			warning(errno, "Unable to readlink(2) '%s'", name);
+	if (image != NULL) {
+		if (ext4_scan(image, argv[0], pn, project))
+			warning(-1, "A problem occurred while scanning '%s'",
+			    image);
+	} else {
+		/* With a spool, only the process which seeds it */
+		if (spool.dir == NULL || spool_seed(argv[0]))
+			output(NULL, argv[0], names_only ? NULL : &st,
+			    S_ISLNK(st.st_mode) ? read_link(AT_FDCWD, argv[0],
+			    argv[0], lnvalue) : NULL, project);
+
+		if (spool.dir != NULL) {
+			if (spool_run(argv[0], fd, st.st_dev))
+				warning(-1, "A problem occurred while "
+				    "traversing '%s'", argv[0]);
+			FS_CLOSE(fd);
+		} else {
+			root = dnode_new(NULL, argv[0], pn, project);
+			if (statlist != NULL ? list_stat(st.st_dev, fd, root)
+			    : dir_lookup(st.st_dev, fd, root))
+				warning(-1, "A problem occurred while "
+				    "traversing '%s'", argv[0]);
+			dnode_unref(root);
 		}
-		if (lnlen < 0)
-			lnlen = 0;
-		lnvalue[lnlen] = '\0';
 
-		fputs(" -> ", fp);
-		for (c = (unsigned char *) lnvalue; c != NULL && *c != '\0'; c++)
-			print_percent_encoded_char(*c, fp);
+		pool_stop();
 	}
 
-	fputc('\n', fp);
+	q = queue_reserve(sizeof(*q));
+	q->type = QREC_END;
+	atomic_store_explicit(&queue.head, atomic_load_explicit(&queue.head,
+	    memory_order_relaxed) + q->len, memory_order_release);
+	pthread_join(outthr, NULL);
+	close_sinks();
+	trace_write();
+	budget_report();
+
+	if (verbose && image == NULL) {
+		fprintf(stderr, "fist: %s profile: %u jobs, batches of %zu, "
+		    "%zu KiB buffers, %s order%s%s\n", profile.name, jobs,
+		    profile.batch, profile.bufsize >> 10,
+		    order_names[profile.order], profile.dtype ? ", d_type" : "",
+		    use_leaf ? ", leaf" : "");
+		fprintf(stderr, "fist: %" PRIu64 " metadata requests, "
+		    "concurrency: average %.1f, final %.1f (max %u)\n",
+		    ctl.total_ops, ctl.windows > 0 ?
+		    ctl.sum_limit / ctl.windows : ctl.limit, ctl.limit,
+		    ctl.max);
+		for (i = 0, inuse = reserved = 0; i < pool.nthreads; i++) {
+			inuse += pool.arenas[i].peak;
+			reserved += pool.arenas[i].peak_reserved;
+		}
+		if (ncpus > 0)
+			fprintf(stderr, "fist: %u threads pinned to %u CPUs\n",
+			    pool.nthreads + 1, ncpus);
+		fprintf(stderr, "fist: arenas peak usage: %zu KiB "
+		    "(%zu KiB reserved)\n", inuse >> 10, reserved >> 10);
+		fprintf(stderr, "fist: output queue: full %" PRIu64 " times, "
+		    "empty %" PRIu64 " times\n", queue.full_waits,
+		    queue.empty_waits);
+		if (spool.dir != NULL)
+			fprintf(stderr, "fist: spool: %" PRIu64 " directories "
+			    "claimed, %" PRIu64 " pushed\n", spool.claims,
+			    spool.pushes);
+#ifdef FIST_SIMFS
+		sim_report(stderr);
+#endif /* FIST_SIMFS */
+	}
+	free(lroot);
+
+	return (0);
 }
 
 
-int
-print_percent_encoded_char(const char c, FILE* fp)
+static void
+usage(void)
 {
-	int rc;
-
-	switch (c) {
-		case '\b':
-		case '\n':
-		case '\r':
-		case '\t':
-		case ' ':
-		case '!':
-		case '"':
-		case '#':
-		case '$':
-		case '%':
-		case '&':
-		case '\'':
-		case '(':
-		case ')':
-		case '*':
-		case '+':
-		case ',':
-		case ':':
-		case ';':
-		case '<':
-		case '=':
-		case '>':
-		case '?':
-		case '@':
-		case '[':
-		case '\\':
-		case ']':
-		case '`':
-		case '{':
-		case '|':
-		case '}':
-		case '~':
-		case 27: /* ESC */
-		case 127: /* DEL */
-			rc = fprintf(fp, "%%%02X", (int) c);
-			break;
-		default:
-			if (isprint(c)) {
-				rc = fputc(c, fp);
-			} else {
-				rc = fprintf(fp, "%%%02hhX", (int) c);
-			}
-			break;
-	}
-
-	return (rc);
+	fprintf(stderr, "usage: fist [-nv] [--noleaf] [-C cpulist] [-j jobs] "
+	    "[-p projects] [--max-memory size]\n"
+	    "            [--fs-profile [name][,setting=value...]] "
+	    "[--spool directory]\n"
+	    "            [--trace [events=N:]file] "
+	    "[-o type[,option=value...]:file]... directory\n");
+	fprintf(stderr, "       fist [options] --ext4-image image directory\n");
+	fprintf(stderr, "       fist [options] --enumerate list directory\n");
+	fprintf(stderr, "       fist [options] --stat-list list\n");
+	fprintf(stderr, "Absolute directory name or \".\" argument required\n");
+	fprintf(stderr, "       fist --trend [from=days,to=days:]history\n");
+	fprintf(stderr, "       fist [-v] --lookup uid=N|gid=N[,...]:dump\n");
+	fprintf(stderr, "Output types: text, bin, users, groups, projects, "
+	    "ext, byuid, bygid, ids, history\n");
+	fprintf(stderr, "Output options: minsize=, maxsize=, olderthan=, "
+	    "newerthan= (days), uid=, gid=, type=f|d|l, bufsize=, "
+	    "maxfiles=, index=\n");
+	exit(1);
 }
 
 
-void
-verror(const int errnum, const char *fmt, va_list ap)
+/*
+ * Simple recursive depth-first directory traversal.
+ * "fd" is an open descriptor on directory "dir", it is closed before
+ * returning.  Objects are looked up relative to "fd", so the current
+ * working directory never changes.
+ * Entries are read by batches (of at most "profile.batch" entries),
+ * lstat'ed concurrently by stat_batch(), then output (and looked into) in
+ * order.  A batch is
+ * allocated in the arenas and released as a whole once processed.
+ *
+ * In "names only" mode, objects are only lstat'ed when their type is
+ * needed to know whether to look inside them: not when "d_type" is
+ * available, nor when all the sub-directories of the directory have
+ * already been found (on filesystems where a directory link count is 2
+ * plus its number of sub-directories).
+ *
+ * "dir->pn" is the projects trie node of this directory (NULL when there is
+ * no project root below) and "dir->project" the project of its objects.
+ */
+int
+dir_lookup(const dev_t dev, const int fd, struct dnode *dir)
 {
-	char *errmsg = NULL;
+	FIST_SSTAT		 st;
+	DIR			*dirp = NULL;
+	struct dirent		*dp = NULL;
+	struct dent		*ents = NULL, *e = NULL, *old = NULL;
+	struct arena		*arena = &pool.arenas[0];
+	struct arena_mark	 start, *marks = NULL;
+	struct dnode		*sub = NULL;
+	const struct pnode	*spn = NULL;
+	char			*parent = NULL;
+	size_t			 n = 0, i, size = 0, unknown, nobjs = 0, rdirs;
+	uint64_t		 tdir, t;
+	nlink_t			 nlink = 0, ndirs = 0;
+	int			 r = 0, sfd = -1, eod = 0, leaf = -1;
+	int			 sproject = -1;
 
-	if (errnum != -1)
-		errmsg = strerror(errnum);
+#ifdef FIST_EMBEDDED
+	walk_push(fd);
+#endif /* FIST_EMBEDDED */
 
-	fprintf(stderr, "fist: ");
-	if (fmt != NULL)
-		vfprintf(stderr, fmt, ap);
+	/* The full name of this directory, while it is traversed */
+	start = arena_mark(arena);
+	parent = dnode_path(dir, arena);
+	tdir = TRACE_NOW();
+	PROBE2(dir_entry, parent, fd);
 
-	if (errnum != -1) {
-		fprintf(stderr, ": %.100s (%d)\n", errmsg, errnum);
-	} else {
-		fputc('\n', stderr);
+	if ((dirp = FS_FDOPENDIR(fd)) == NULL) {
+		warning(errno, "Unable to open directory '%s'", parent);
+		FS_CLOSE(fd);
+#ifdef FIST_EMBEDDED
+		walk.n--;
+#endif /* FIST_EMBEDDED */
+		PROBE3(dir_return, parent, 0, -1);
+		arena_release(arena, &start);
+		return (-1);
 	}
-}
+#ifdef FIST_EMBEDDED
+	walk.dirs[walk.n - 1].dirp = dirp;
+#endif /* FIST_EMBEDDED */
 
+	while (!eod) {
+		marks = pool_mark();
+		size = 0;
+		t = TRACE_NOW();
+		if (spool.dir != NULL)
+			spool_renew();
 
-void
-error(const int excode, const int errnum, const char *fmt, ...)
-{
+		/* Read a batch of entries */
+		for (n = unknown = 0; n < profile.batch; ) {
+			if ((dp = FS_READDIR(dirp)) == NULL) {
+				eod = 1;
+				break;
+			}
+			/*
+			 * '.' and '..' are never printed (except for the
+			 * root, printed by the caller) nor looked into.
+			 */
+			if (IS_DOT_OR_DOTDOT(dp->d_name))
+				continue;
+
+			if (n == size) {
+				size = size == 0 ? 64 : size * 2;
+				old = ents;
+				ents = arena_alloc(arena, size * sizeof(*ents));
+				if (n > 0)
+					memcpy(ents, old, n * sizeof(*ents));
+			}
+			e = &ents[n++];
+			e->name = arena_strdup(arena, dp->d_name);
+			e->lname = NULL;
+			e->has_st = 0;
+			e->isdir = -1;
+			e->ino = dp->d_ino;
+#ifdef DT_DIR
+			if (profile.dtype && dp->d_type != DT_UNKNOWN)
+				e->isdir = (dp->d_type == DT_DIR);
+#endif /* DT_DIR */
+			e->need_st = !names_only || e->isdir == -1;
+			if (e->isdir == 1)
+				ndirs++;
+			else if (e->isdir == -1)
+				unknown++;
+		}
+		trace_span(TRACE_READDIR, 0, t, n, parent, NULL);
+		nobjs += n;
+
+		/*
+		 * Without lstat(2) results, objects of unknown type are not
+		 * directories once all the sub-directories have been found.
+		 */
+		if (names_only && unknown > 0 && use_leaf) {
+			if (leaf == -1) {
+				leaf = 0;
+				if (FS_FSTAT(fd, &st) == 0
+				    && st.st_nlink >= 2) {
+					nlink = st.st_nlink - 2;
+					leaf = 1;
+				}
+			}
+			if (leaf == 1 && ndirs >= nlink)
+				for (i = 0; i < n; i++)
+					if (ents[i].isdir == -1) {
+						ents[i].isdir = 0;
+						ents[i].need_st = 0;
+					}
+		}
+
+		stat_batch(ents, n, fd, parent);
+
+		/* Sub-directories of the batch not yet looked into */
+		for (i = rdirs = 0; i < n; i++)
+			rdirs += ents[i].isdir == 1
+			    && (!ents[i].need_st || ents[i].has_st);
+
+		for (i = 0; i < n; i++) {
+			e = &ents[i];
+			if (e->need_st && !e->has_st)
+				continue;	/* lstat(2) failed */
+			if (names_only && e->has_st && e->isdir)
+				ndirs++;
+
+			/* A sub-directory may be the root of a project */
+			spn = NULL;
+			sproject = dir->project;
+			if (e->isdir && dir->pn != NULL
+			    && (spn = pnode_child(dir->pn, e->name, 0)) != NULL
+			    && spn->project != -1)
+				sproject = spn->project;
+
+			output(dir, e->name, names_only ? NULL : &e->st,
+			    e->lname, sproject);
+
+			if (!e->isdir)
+				continue;
+			rdirs--;
+
+			/*
+			 * If the current object is:
+			 *  - a directory,
+			 *  - not a mount point (when lstat'ed, otherwise the
+			 *    kernel or open_subdir() will tell),
+			 * then we'll try to look inside it.
+			 */
+			if (e->has_st && e->st.st_dev != dev)
+				continue;
+
+			/* Leave it to idle processes, keep one at least */
+			if (spool.dir != NULL && rdirs > 0 && spool_hungry()
+			    && spool_push(parent, e->name) == 0)
+				continue;
+
+			sub = dnode_new(dir, e->name, spn, sproject);
+#ifdef FIST_EMBEDDED
+			walk.dirs[walk.n - 1].sub = sub;
+#endif /* FIST_EMBEDDED */
+			t = TRACE_NOW();
+			sfd = open_subdir(fd, e->name, dev,
+			    e->has_st ? &e->st : NULL);
+			trace_span(TRACE_OPEN, 0, t, 0, parent, e->name);
+			if (sfd == -1) {
+				/*
+				 * EXDEV: it is (or became) a mount point (or
+				 * is a bind mount), silently skipped like the
+				 * other mount points.
+				 */
+				if (errno != EXDEV) {
+					warning(errno, "Unable to open "
+					    "directory '%s/%s'", parent,
+					    e->name);
+					r = -1;
+				}
+			} else
+				r = dir_lookup(dev, sfd, sub);
+#ifdef FIST_EMBEDDED
+			walk.dirs[walk.n - 1].sub = NULL;
+#endif /* FIST_EMBEDDED */
+			dnode_unref(sub);
+		}
+
+		pool_release(marks);
+	}
+
+#ifdef FIST_EMBEDDED
+	walk.n--;
+#endif /* FIST_EMBEDDED */
+	if (FS_CLOSEDIR(dirp) == -1)
+		warning(errno, "Error while closing directory '%s'", parent);
+	trace_span(TRACE_DIR, 0, tdir, nobjs, parent, NULL);
+	PROBE3(dir_return, parent, nobjs, r);
+
+	arena_release(arena, &start);
+
+	return (r);
+}
+
+
+#ifdef FIST_EMBEDDED
+/*
+ * Directory "fd" is being traversed by the walker (closed if it can't be
+ * recorded).
+ */
+static void
+walk_push(const int fd)
+{
+	struct walk_dir	*dirs = NULL;
+	size_t		 size;
+
+	if (walk.n == walk.size) {
+		size = walk.size == 0 ? 64 : walk.size * 2;
+		if ((dirs = realloc(walk.dirs, size * sizeof(*dirs))) == NULL) {
+			FS_CLOSE(fd);
+			error(1, errno, "Unable to allocate directory");
+		}
+		walk.dirs = dirs;
+		walk.size = size;
+	}
+	walk.dirs[walk.n].fd = fd;
+	walk.dirs[walk.n].dirp = NULL;
+	walk.dirs[walk.n++].sub = NULL;
+}
+
+
+/*
+ * Close the directories left open by the walker (after an error) and drop
+ * the references of the sub-directories it was looking into.
+ */
+static void
+walk_close(void)
+{
+	struct walk_dir	*w = NULL;
+
+	while (walk.n > 0) {
+		w = &walk.dirs[--walk.n];
+		if (w->dirp != NULL)
+			FS_CLOSEDIR(w->dirp);
+		else
+			FS_CLOSE(w->fd);
+		dnode_unref(w->sub);
+	}
+	free(walk.dirs);
+	memset(&walk, 0, sizeof(walk));
+}
+#endif /* FIST_EMBEDDED */
+
+
+static struct dnode *
+dnode_new(struct dnode *parent, const char *name, const struct pnode *pn,
+    const int project)
+{
+	struct dnode	*d = NULL;
+	size_t		 len = strlen(name);
+
+	if ((d = malloc(sizeof(*d) + len + 1)) == NULL)
+		error(1, errno, "Unable to allocate directory");
+	budget_take(sizeof(*d) + len + 1, 1);
+	memcpy(d->name, name, len + 1);
+	d->len = len;
+	atomic_init(&d->refs, 1);
+	d->pn = pn;
+	d->project = project;
+	if ((d->parent = parent) != NULL)
+		atomic_fetch_add(&parent->refs, 1);
+
+	return (d);
+}
+
+
+/*
+ * Drop a reference, a directory holds a reference on its parent.
+ */
+static void
+dnode_unref(struct dnode *d)
+{
+	struct dnode	*parent = NULL;
+
+	for (; d != NULL && atomic_fetch_sub(&d->refs, 1) == 1; d = parent) {
+		parent = d->parent;
+		budget_give(sizeof(*d) + d->len + 1);
+		free(d);
+	}
+}
+
+
+/*
+ * Full name of a directory, allocated in arena "a".
+ */
+static char *
+dnode_path(const struct dnode *d, struct arena *a)
+{
+	const struct dnode	*p = NULL;
+	char			*path = NULL, *c = NULL;
+	size_t			 len = 0;
+
+	for (p = d; p != NULL; p = p->parent)
+		len += p->len + 1;
+
+	path = arena_alloc(a, len);
+	c = path + len - 1;
+	*c = '\0';
+	for (p = d; p != NULL; p = p->parent) {
+		c -= p->len;
+		memcpy(c, p->name, p->len);
+		if (p->parent != NULL)
+			*--c = '/';
+	}
+
+	return (path);
+}
+
+
+/*
+ * lstat (and readlink) the entries of a batch which require it, using as
+ * many threads as allowed by the concurrency controller.
+ */
+static void
+stat_batch(struct dent *ents, const size_t n, const int dfd,
+    const char *parent)
+{
+	unsigned	 p;
+	size_t		 need, i;
+	uint64_t	 start;
+
+	for (i = need = 0; i < n; i++)
+		need += ents[i].need_st;
+	if (need == 0)
+		return;
+
+	p = (unsigned) ctl.limit;
+	if (p > (need + STAT_PER_THREAD - 1) / STAT_PER_THREAD)
+		p = (need + STAT_PER_THREAD - 1) / STAT_PER_THREAD;
+	if (p > pool.nthreads)
+		p = pool.nthreads;
+	/* Each thread may need arena chunks */
+	if (p > 1 && budget_over()) {
+		p = 1;
+		atomic_fetch_or(&budget.degraded, BUDGET_JOBS);
+	}
+	if (p < 1)
+		p = 1;
+
+	start = now_ns();
+
+	if (profile.order == ORDER_INODE)
+		stat_order(ents, n, &pool.arenas[0]);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.ents = ents;
+	pool.nents = n;
+	pool.dfd = dfd;
+	pool.parent = parent;
+	pool.ops = pool.lat_ns = 0;
+	atomic_store(&pool.next, 0);
+	pool.participants = p;
+	pool.busy = p - 1;
+	if (p > 1) {
+		pool.generation++;
+		pthread_cond_broadcast(&pool.work);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	/* The walker is thread "0" */
+	pool_run(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+#ifdef FIST_EMBEDDED
+	if (error_jmp != NULL && atomic_load(&error_raised))
+		longjmp(*error_jmp, 1);
+#endif /* FIST_EMBEDDED */
+
+	pool.order = NULL;
+	controller_update(pool.ops, pool.lat_ns, now_ns() - start);
+	trace_span(TRACE_STAT, 0, start, need, parent, NULL);
+}
+
+
+/*
+ * Process entries of the current batch, as thread "id".
+ */
+static void
+pool_run(const unsigned id)
+{
+	char		 lnvalue[PATH_MAX];
+	struct dent	*e = NULL;
+	uint64_t	 ops = 0, lat_ns = 0, t, tstart;
+	size_t		 i;
+	int		 r;
+
+	tstart = TRACE_NOW();
+	while ((i = atomic_fetch_add(&pool.next, 1)) < pool.nents) {
+		e = &pool.ents[pool.order != NULL ? pool.order[i] : i];
+		if (!e->need_st)
+			continue;
+
+		t = now_ns();
+		PROBE2(lstat_entry, pool.parent, e->name);
+		r = FS_FSTATAT(pool.dfd, e->name, &e->st, AT_SYMLINK_NOFOLLOW);
+		PROBE2(lstat_return, e->name, r == -1 ? errno : 0);
+		if (r == -1) {
+			warning(errno, "Unable to lstat('%s%s%s')",
+			    pool.parent != NULL ? pool.parent : "",
+			    pool.parent != NULL ? "/" : "",
+			    e->name);
+			continue;
+		}
+		lat_ns += now_ns() - t;
+		ops++;
+
+		e->has_st = 1;
+		e->isdir = S_ISDIR(e->st.st_mode);
+		if (!names_only && S_ISLNK(e->st.st_mode))
+			e->lname = arena_strdup(&pool.arenas[id],
+			    read_link(pool.dfd, e->name, e->name, lnvalue));
+	}
+
+	if (ops > 0)
+		trace_span(TRACE_LSTAT, id == 0 ? 0 : id + 1, tstart, ops,
+		    pool.parent, NULL);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.ops += ops;
+	pool.lat_ns += lat_ns;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
+#ifdef FIST_EMBEDDED
+/*
+ * pool_run() for a pool thread, out of the batch on error (the walker
+ * fails after it).
+ */
+static void
+pool_try(const unsigned id)
+{
+	jmp_buf	jb;
+
+	error_jmp = &jb;
+	if (setjmp(jb) == 0)
+		pool_run(id);
+	error_jmp = NULL;
+}
+#endif /* FIST_EMBEDDED */
+
+
+static void *
+pool_thread(void *arg)
+{
+	unsigned	id = (unsigned) (uintptr_t) arg;
+	unsigned	seen = 0;
+
+	pin_thread(id + 1);
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		/* Wait for a batch for which this thread is needed */
+		while (!pool.quit && (seen == pool.generation
+		    || id >= pool.participants)) {
+			seen = pool.generation;
+			pthread_cond_wait(&pool.work, &pool.lock);
+		}
+		if (pool.quit)
+			break;
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+#ifdef FIST_EMBEDDED
+		pool_try(id);
+#else
+		pool_run(id);
+#endif /* FIST_EMBEDDED */
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return (NULL);
+}
+
+
+static void
+pool_start(const unsigned jobs)
+{
+	void		*p = NULL;
+	unsigned	 i;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	ctl.max = jobs;
+	ctl.limit = jobs < 4 ? jobs : 4;
+
+	pool.nthreads = jobs;
+	if ((errno = posix_memalign(&p, ARENA_CACHELINE,
+	    jobs * sizeof(*pool.arenas))) != 0)
+		error(1, errno, "Unable to allocate arenas");
+	pool.arenas = p;
+	memset(pool.arenas, 0, jobs * sizeof(*pool.arenas));
+	if (jobs == 1)
+		return;
+	if ((pool.threads = calloc(jobs, sizeof(*pool.threads))) == NULL)
+		error(1, errno, "Unable to allocate threads");
+	for (i = 1; i < jobs; i++)
+		if ((errno = pthread_create(&pool.threads[i], NULL,
+		    pool_thread, (void *) (uintptr_t) i)) != 0) {
+			pool.nthreads = i;	/* for pool_stop() */
+			error(1, errno, "Unable to create thread");
+		}
+}
+
+
+static void
+pool_stop(void)
+{
+	unsigned	i;
+
+	if (pool.threads == NULL)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 1; i < pool.nthreads; i++)
+		pthread_join(pool.threads[i], NULL);
+	free(pool.threads);
+	pool.threads = NULL;
+}
+
+
+/*
+ * Parse a Linux "cpulist" (e.g. "0-7,16-23", see cpuset(7)) for -C.
+ * The CPUs of a NUMA node are listed in
+ * /sys/devices/system/node/nodeN/cpulist.
+ */
+static void
+parse_cpulist(const char *list)
+{
+	const char	*p = list;
+	char		*end = NULL;
+	unsigned long	 first, last, c;
+
+	for (;;) {
+		errno = 0;
+		first = last = strtoul(p, &end, 10);
+		if (end == p || errno != 0)
+			break;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || errno != 0 || last < first)
+				break;
+		}
+		if (last >= CPU_MAX)
+			break;
+		for (c = first; c <= last; c++) {
+			if ((cpus = realloc(cpus, (ncpus + 1) * sizeof(*cpus)))
+			    == NULL)
+				error(1, errno, "Unable to allocate CPU list");
+			cpus[ncpus++] = (unsigned) c;
+		}
+		if (*end == '\0')
+			return;
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+	error(1, -1, "Invalid CPU list '%s'", list);
+}
+
+
+/*
+ * Pin the calling thread to a CPU of the -C list.
+ * "id" is the thread number: "0" is the walker, "1" the output thread,
+ * then the pool threads, so that the busiest threads get their own CPU.
+ * The walker is pinned before anything is allocated and the other threads
+ * allocate their arenas chunks (and the output thread grows the outputs
+ * tables) themselves, so memory is first touched on the thread NUMA node.
+ */
+static void
+pin_thread(const unsigned id)
+{
+#ifdef __linux__
+	cpu_set_t	set;
+
+	if (ncpus == 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpus[id % ncpus], &set);
+	if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set),
+	    &set)) != 0)
+		error(1, errno, "Unable to use CPU %u", cpus[id % ncpus]);
+#else
+	(void) id;
+#endif /* __linux__ */
+}
+
+
+/*
+ * Number of CPUs usable by the process: the -C list or the affinity mask,
+ * limited by the CPU quota of its control group (cgroup v2 "cpu.max" or
+ * v1 "cpu.cfs_quota_us" of the cgroup and its ancestors).
+ */
+static unsigned
+available_cpus(void)
+{
+	char		 line[PATH_MAX], dir[PATH_MAX + 64], *cg = NULL;
+	char		*ctrl = NULL, *p = NULL;
+	FILE		*fp = NULL;
+	unsigned	 n, q;
+	long		 nproc;
+	int		 v2;
+#ifdef __linux__
+	cpu_set_t	 set;
+#endif
+
+	if ((nproc = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nproc = 1;
+	n = (unsigned) nproc;
+#ifdef __linux__
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		n = (unsigned) CPU_COUNT(&set);
+#endif
+	if (ncpus > 0)
+		n = ncpus;
+
+	if ((fp = fopen("/proc/self/cgroup", "r")) == NULL)
+		return (n);
+	/* "0::/path" (v2) or "N:cpu,cpuacct:/path" (v1) */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((ctrl = strchr(line, ':')) == NULL
+		    || (cg = strchr(++ctrl, ':')) == NULL)
+			continue;
+		*cg++ = '\0';
+		v2 = ctrl[0] == '\0';
+		if (!v2 && strcmp(ctrl, "cpu") != 0
+		    && strncmp(ctrl, "cpu,", 4) != 0
+		    && strstr(ctrl, ",cpu,") == NULL
+		    && (strlen(ctrl) < 4
+		    || strcmp(ctrl + strlen(ctrl) - 4, ",cpu") != 0))
+			continue;
+
+		/* From the cgroup up to the hierarchy root */
+		for (;;) {
+			snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s%s%s",
+			    v2 ? "" : "/", ctrl, strcmp(cg, "/") == 0 ? ""
+			    : cg);
+			if ((q = cgroup_quota(dir, v2)) > 0 && q < n)
+				n = q;
+			if ((p = strrchr(cg, '/')) == NULL || p == cg)
+				break;
+			*p = '\0';
+		}
+		if (cg[0] == '/' && cg[1] != '\0') {
+			cg[1] = '\0';
+			snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s%s",
+			    v2 ? "" : "/", ctrl);
+			if ((q = cgroup_quota(dir, v2)) > 0 && q < n)
+				n = q;
+		}
+	}
+	fclose(fp);
+
+	return (n);
+}
+
+
+/*
+ * CPU quota of cgroup directory "dir", rounded up (0: none).
+ */
+static unsigned
+cgroup_quota(const char *dir, const int v2)
+{
+	char		 path[PATH_MAX + 96], buf[64];
+	FILE		*fp = NULL;
+	long long	 quota = -1, period = 0;
+
+	if (v2) {
+		snprintf(path, sizeof(path), "%s/cpu.max", dir);
+		if ((fp = fopen(path, "r")) == NULL)
+			return (0);
+		if (fgets(buf, sizeof(buf), fp) == NULL
+		    || sscanf(buf, "%lld %lld", &quota, &period) != 2)
+			quota = -1;
+		fclose(fp);
+	} else {
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+		if ((fp = fopen(path, "r")) == NULL)
+			return (0);
+		if (fscanf(fp, "%lld", &quota) != 1)
+			quota = -1;
+		fclose(fp);
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		if ((fp = fopen(path, "r")) == NULL)
+			return (0);
+		if (fscanf(fp, "%lld", &period) != 1)
+			period = 0;
+		fclose(fp);
+	}
+
+	/* "max" (v2) or -1 (v1): no quota */
+	if (quota <= 0 || period <= 0)
+		return (0);
+	return ((unsigned) ((quota + period - 1) / period));
+}
+
+
+/*
+ * Mark all the arenas before a batch (the walker's first, the marks are
+ * allocated from it).
+ * The pool threads only allocate while the walker waits for them in
+ * stat_batch(), so the walker can mark and release their arenas.
+ */
+static struct arena_mark *
+pool_mark(void)
+{
+	struct arena_mark	 m, *marks = NULL;
+	unsigned		 i;
+
+	m = arena_mark(&pool.arenas[0]);
+	marks = arena_alloc(&pool.arenas[0], pool.nthreads * sizeof(*marks));
+	marks[0] = m;
+	for (i = 1; i < pool.nthreads; i++)
+		marks[i] = arena_mark(&pool.arenas[i]);
+
+	return (marks);
+}
+
+
+static void
+pool_release(struct arena_mark *marks)
+{
+	struct arena_mark	m = marks[0];
+	unsigned		i;
+
+	for (i = 1; i < pool.nthreads; i++)
+		arena_release(&pool.arenas[i], &marks[i]);
+	arena_release(&pool.arenas[0], &m);
+}
+
+
+static void *
+arena_alloc(struct arena *a, const size_t len)
+{
+	struct arena_chunk	*c = NULL, **cp = NULL;
+	size_t			 size = ARENA_ALIGN(len);
+	void			*p = NULL;
+
+	if (a->cur == NULL || a->cur->size - a->cur->used < size) {
+		/* A spare chunk large enough or a new one */
+		for (cp = &a->spare; *cp != NULL; cp = &(*cp)->prev)
+			if ((*cp)->size >= size)
+				break;
+		if ((c = *cp) != NULL)
+			*cp = c->prev;
+		else {
+			c = malloc(ARENA_CHUNK_HDR + (size > ARENA_CHUNK_SIZE ?
+			    size : ARENA_CHUNK_SIZE));
+			if (c == NULL)
+				error(1, errno, "Unable to allocate memory");
+			c->size = size > ARENA_CHUNK_SIZE ? size
+			    : ARENA_CHUNK_SIZE;
+			budget_take(ARENA_CHUNK_HDR + c->size, 1);
+			a->reserved += ARENA_CHUNK_HDR + c->size;
+			if (a->reserved > a->peak_reserved)
+				a->peak_reserved = a->reserved;
+		}
+		c->used = 0;
+		c->prev = a->cur;
+		a->cur = c;
+	}
+
+	p = (char *) a->cur + ARENA_CHUNK_HDR + a->cur->used;
+	a->cur->used += size;
+	a->inuse += size;
+	if (a->inuse > a->peak)
+		a->peak = a->inuse;
+
+	return (p);
+}
+
+
+static char *
+arena_strdup(struct arena *a, const char *str)
+{
+	size_t	 len = strlen(str) + 1;
+
+	return (memcpy(arena_alloc(a, len), str, len));
+}
+
+
+static struct arena_mark
+arena_mark(const struct arena *a)
+{
+	struct arena_mark	m;
+
+	m.chunk = a->cur;
+	m.used = a->cur != NULL ? a->cur->used : 0;
+	m.inuse = a->inuse;
+
+	return (m);
+}
+
+
+/*
+ * Release everything allocated since mark "m", the chunks allocated since
+ * are kept for reuse (unless the memory budget is exhausted).
+ */
+static void
+arena_release(struct arena *a, const struct arena_mark *m)
+{
+	struct arena_chunk	*c = NULL;
+
+	while (a->cur != m->chunk) {
+		c = a->cur;
+		a->cur = c->prev;
+		c->prev = a->spare;
+		a->spare = c;
+	}
+	while (a->spare != NULL && budget_over()) {
+		c = a->spare;
+		a->spare = c->prev;
+		a->reserved -= ARENA_CHUNK_HDR + c->size;
+		budget_give(ARENA_CHUNK_HDR + c->size);
+		free(c);
+		atomic_fetch_or(&budget.degraded, BUDGET_ARENAS);
+	}
+	if (a->cur != NULL)
+		a->cur->used = m->used;
+	a->inuse = m->inuse;
+}
+
+
+
+/*
+ * Free all the chunks of arena "a".
+ */
+static void
+arena_free(struct arena *a)
+{
+	struct arena_chunk	*c = NULL, *lists[2];
+	unsigned		 i;
+
+	lists[0] = a->cur;
+	lists[1] = a->spare;
+	for (i = 0; i < 2; i++)
+		while ((c = lists[i]) != NULL) {
+			lists[i] = c->prev;
+			budget_give(ARENA_CHUNK_HDR + c->size);
+			free(c);
+		}
+	a->cur = a->spare = NULL;
+	a->inuse = a->reserved = 0;
+}
+
+/*
+ * Account for a batch ("ops" requests, with a total latency of "lat_ns",
+ * in "wall_ns") and adjust the concurrency limit at the end of each
+ * measurement window.
+ */
+static void
+controller_update(const uint64_t ops, const uint64_t lat_ns,
+    const uint64_t wall_ns)
+{
+	double	tput, lat, gradient, target;
+
+	ctl.total_ops += ops;
+	ctl.win_ops += ops;
+	ctl.win_lat_ns += lat_ns;
+	ctl.win_wall_ns += wall_ns;
+	if (ctl.max <= 1 || ctl.win_wall_ns < CTL_WINDOW_NS
+	    || ctl.win_ops < CTL_WINDOW_OPS)
+		return;
+
+	tput = (double) ctl.win_ops / (double) ctl.win_wall_ns;
+	lat = (double) ctl.win_lat_ns / (double) ctl.win_ops;
+	ctl.win_ops = ctl.win_lat_ns = ctl.win_wall_ns = 0;
+
+	/* The lowest latency is forgotten from time to time */
+	if (ctl.min_lat == 0 || lat < ctl.min_lat
+	    || ctl.windows % CTL_REPROBE == 0)
+		ctl.min_lat = lat;
+	ctl.windows++;
+
+	if (ctl.prev_tput > 0 && ctl.limit > ctl.prev_limit
+	    && tput < ctl.prev_tput * 0.9) {
+		/* More requests in flight made it slower */
+		target = ctl.prev_limit * 0.75;
+	} else {
+		gradient = ctl.min_lat / lat;
+		if (gradient < 0.5)
+			gradient = 0.5;
+		if (gradient > 1.0)
+			gradient = 1.0;
+		target = ctl.limit * gradient + sqrt(ctl.limit);
+	}
+
+	ctl.prev_tput = tput;
+	ctl.prev_limit = ctl.limit;
+	ctl.limit = ctl.limit * 0.8 + target * 0.2;
+	if (ctl.limit < 1.0)
+		ctl.limit = 1.0;
+	if (ctl.limit > (double) ctl.max)
+		ctl.limit = (double) ctl.max;
+	ctl.sum_limit += ctl.limit;
+}
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec);
+}
+
+
+/*
+ * Enable the trace, "[events=N:]file".
+ */
+static void
+trace_init(const char *arg)
+{
+	char	*spec = NULL, *val = NULL;
+
+	if ((spec = strdup(arg)) == NULL)
+		error(1, errno, "Unable to allocate trace");
+	trace.path = spec;
+	trace.size = TRACE_EVENTS;
+	if (strncmp(spec, "events=", 7) == 0) {
+		if ((val = strchr(spec, ':')) == NULL)
+			error(1, -1, "Invalid trace '%s' (no file)", arg);
+		*val++ = '\0';
+		trace.path = val;
+		if ((trace.size = (size_t) parse_number("events", spec + 7))
+		    == 0)
+			error(1, -1, "Invalid trace size '%s'", spec + 7);
+	}
+}
+
+
+/*
+ * Allocate the trace ring (smaller if the memory budget is exhausted).
+ */
+static void
+trace_start(void)
+{
+	if (trace.path == NULL)
+		return;
+
+	trace.size = budget_fit(trace.size * sizeof(*trace.ring),
+	    TRACE_MIN * sizeof(*trace.ring), BUDGET_TRACE)
+	    / sizeof(*trace.ring);
+	if ((trace.ring = calloc(trace.size, sizeof(*trace.ring))) == NULL)
+		error(1, errno, "Unable to allocate trace");
+	atomic_init(&trace.next, 0);
+	trace.t0 = now_ns();
+}
+
+
+/*
+ * Record a span of "kind" started at "start" (TRACE_NOW()) by thread "tid"
+ * on "count" entries, for object "dir" (or "dir/name").
+ * Only the end of the full name is kept.
+ */
+static void
+trace_span(const int kind, const unsigned tid, const uint64_t start,
+    const size_t count, const char *dir, const char *name)
+{
+	struct trace_ev	*ev = NULL;
+	size_t		 dlen, nlen, skip;
+	char		*p = NULL;
+
+	if (trace.ring == NULL)
+		return;
+
+	ev = &trace.ring[atomic_fetch_add_explicit(&trace.next, 1,
+	    memory_order_relaxed) % trace.size];
+	ev->start = start - trace.t0;
+	ev->dur = now_ns() - start;
+	ev->count = count > UINT32_MAX ? UINT32_MAX : (uint32_t) count;
+	ev->tid = (uint16_t) tid;
+	ev->kind = (uint8_t) kind;
+
+	dlen = dir != NULL ? strlen(dir) : 0;
+	nlen = name != NULL ? strlen(name) + 1 : 0;
+	skip = dlen + nlen >= TRACE_NAMELEN ? dlen + nlen - TRACE_NAMELEN + 1
+	    : 0;
+	p = ev->name;
+	if (skip < dlen) {
+		memcpy(p, dir + skip, dlen - skip);
+		p += dlen - skip;
+		skip = 0;
+	} else
+		skip -= dlen;
+	if (nlen > 0) {
+		if (skip == 0)
+			*p++ = '/';
+		else
+			skip--;
+		memcpy(p, name + skip, nlen - 1 - skip);
+		p += nlen - 1 - skip;
+	}
+	*p = '\0';
+}
+
+
+/*
+ * Write the recorded spans (the most recent ones if the ring is full) in
+ * the Chrome trace-event format, with the names of the threads.
+ */
+static void
+trace_write(void)
+{
+	struct trace_ev	*ev = NULL;
+	FILE		*fp = NULL;
+	size_t		 next, first, i;
+	unsigned	 tid;
+
+	if (trace.ring == NULL)
+		return;
+
+	if ((fp = fopen(trace.path, "w")) == NULL)
+		error(1, errno, "Unable to open trace file '%s'", trace.path);
+
+	next = atomic_load(&trace.next);
+	first = next > trace.size ? next - trace.size : 0;
+
+	fprintf(fp, "{\n\"displayTimeUnit\": \"ms\",\n"
+	    "\"otherData\": {\"events\": %zu, \"dropped\": %zu},\n"
+	    "\"traceEvents\": [\n", next, first);
+	fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+	    "\"tid\": 0, \"args\": {\"name\": \"walker\"}},\n");
+	fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+	    "\"tid\": 1, \"args\": {\"name\": \"output\"}}");
+	for (tid = 1; tid < pool.nthreads; tid++)
+		fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+		    "\"pid\": 1, \"tid\": %u, \"args\": {\"name\": "
+		    "\"stat %u\"}}", tid + 1, tid);
+
+	for (i = first; i < next; i++) {
+		ev = &trace.ring[i % trace.size];
+		fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"fist\", "
+		    "\"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, "
+		    "\"dur\": %.3f, \"args\": {\"count\": %" PRIu32,
+		    trace_names[ev->kind], ev->tid, ev->start / 1e3,
+		    ev->dur / 1e3, ev->count);
+		if (ev->name[0] != '\0') {
+			fprintf(fp, ", \"name\": ");
+			print_json_string(fp, ev->name);
+		}
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "\n]\n}\n");
+
+	if (fclose(fp) == EOF)
+		error(1, errno, "Error while writing to '%s'", trace.path);
+	if (verbose)
+		fprintf(stderr, "fist: trace: %zu events (%zu dropped)\n",
+		    next - first, first);
+}
+
+
+/*
+ * Reserve "n" bytes of the memory budget, unless it would be exceeded and
+ * the memory is not required ("must").
+ * Returns -1 if the budget is (or would be) exceeded.
+ */
+static int
+budget_take(const size_t n, const int must)
+{
+	size_t	 used, peak;
+
+	used = atomic_fetch_add_explicit(&budget.used, n,
+	    memory_order_relaxed) + n;
+	if (budget.limit > 0 && used > budget.limit && !must) {
+		atomic_fetch_sub_explicit(&budget.used, n,
+		    memory_order_relaxed);
+		return (-1);
+	}
+
+	peak = atomic_load_explicit(&budget.peak, memory_order_relaxed);
+	while (used > peak && !atomic_compare_exchange_weak_explicit(
+	    &budget.peak, &peak, used, memory_order_relaxed,
+	    memory_order_relaxed))
+		;
+
+	return (budget.limit > 0 && used > budget.limit ? -1 : 0);
+}
+
+
+static void
+budget_give(const size_t n)
+{
+	atomic_fetch_sub_explicit(&budget.used, n, memory_order_relaxed);
+}
+
+
+static int
+budget_over(void)
+{
+	return (budget.limit > 0 && atomic_load_explicit(&budget.used,
+	    memory_order_relaxed) > budget.limit);
+}
+
+
+/*
+ * Reserve "want" bytes, or the largest half, quarter... of it down to
+ * "min" (reserved anyway) which fits in the budget, noting "what" was
+ * reduced.
+ */
+static size_t
+budget_fit(const size_t want, const size_t min, const unsigned what)
+{
+	size_t	 n;
+
+	for (n = want; n > min && budget_take(n, 0) == -1; n /= 2)
+		;
+	if (n <= min) {
+		n = want < min ? want : min;
+		budget_take(n, 1);
+	}
+	if (n < want)
+		atomic_fetch_or(&budget.degraded, what);
+
+	return (n);
+}
+
+
+/*
+ * Peak memory use (of the accounted data structures) and what was reduced
+ * to stay within the budget.
+ */
+static void
+budget_report(void)
+{
+	unsigned	 degraded = atomic_load(&budget.degraded), i;
+	const char	*sep = "";
+
+	if (budget.limit == 0 && !verbose)
+		return;
+
+	fprintf(stderr, "fist: memory: peak %zu KiB", atomic_load(&budget.peak)
+	    >> 10);
+	if (budget.limit > 0)
+		fprintf(stderr, " (budget %zu KiB)", budget.limit >> 10);
+	if (degraded != 0) {
+		fprintf(stderr, ", reduced: ");
+		for (i = 0; i < sizeof(budget_names) / sizeof(*budget_names);
+		    i++)
+			if (degraded & (1U << i)) {
+				fprintf(stderr, "%s%s", sep, budget_names[i]);
+				sep = ", ";
+			}
+	}
+	fprintf(stderr, "\n");
+}
+
+
+/*
+ * Create the spool (if needed) and seed it with the root ticket if no
+ * other process did, then wait for the root ticket to be available.
+ * Returns 1 if this process seeded the spool.
+ */
+static int
+spool_seed(const char *root)
+{
+	char		 path[PATH_MAX];
+	const char	*subs[] = { "", "/todo", "/claimed", "/tmp" };
+	FIST_SSTAT	 st;
+	size_t		 i;
+	int		 fd, seeded = 0;
+
+	if (gethostname(spool.host, sizeof(spool.host)) == -1)
+		strlcpy(spool.host, "localhost", sizeof(spool.host));
+	spool.host[sizeof(spool.host) - 1] = '\0';
+	snprintf(spool.id, sizeof(spool.id), "%s.%ld", spool.host,
+	    (long) getpid());
+
+	for (i = 0; i < sizeof(subs) / sizeof(*subs); i++) {
+		snprintf(path, sizeof(path), "%s%s", spool.dir, subs[i]);
+		if (mkdir(path, 0777) == -1 && errno != EEXIST)
+			error(1, errno, "Unable to create spool '%s'", path);
+	}
+
+	snprintf(path, sizeof(path), "%s/seed", spool.dir);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666))
+	    != -1) {
+		if (spool_push(root, NULL) == -1)
+			error(1, -1, "Unable to seed spool '%s'", spool.dir);
+		if (write(fd, spool.id, strlen(spool.id)) == -1
+		    || close(fd) == -1)
+			error(1, errno, "Unable to write '%s'", path);
+		seeded = 1;
+	} else if (errno != EEXIST)
+		error(1, errno, "Unable to create '%s'", path);
+
+	/* The seed is written once the root ticket is available */
+	while (FIST_LSTAT(path, &st) == 0 && st.st_size == 0)
+		nanosleep(&(struct timespec) { 0, SPOOL_POLL_NS }, NULL);
+
+	return (seeded);
+}
+
+
+/*
+ * Push directory "dir/name" (or "dir") as a ticket.
+ */
+static int
+spool_push(const char *dir, const char *name)
+{
+	char	 tmp[PATH_MAX], todo[PATH_MAX];
+	size_t	 len;
+	int	 fd, r = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s/tmp/%s.%" PRIu64, spool.dir, spool.id,
+	    spool.seq);
+	snprintf(todo, sizeof(todo), "%s/todo/%s.%" PRIu64, spool.dir,
+	    spool.id, spool.seq++);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))
+	    == -1) {
+		warning(errno, "Unable to create ticket '%s'", tmp);
+		return (-1);
+	}
+	len = strlen(dir);
+	if (write(fd, dir, len) != (ssize_t) len || (name != NULL
+	    && (write(fd, "/", 1) != 1 || write(fd, name, strlen(name))
+	    != (ssize_t) strlen(name))))
+		r = -1;
+	if (close(fd) == -1 || r == -1 || rename(tmp, todo) == -1) {
+		warning(errno, "Unable to write ticket '%s'", todo);
+		unlink(tmp);
+		return (-1);
+	}
+
+	spool.waiting++;
+	spool.pushes++;
+
+	return (0);
+}
+
+
+/*
+ * Whether few tickets are waiting (other processes may be idle), they are
+ * counted at most once per SPOOL_CHECK_NS.
+ */
+static int
+spool_hungry(void)
+{
+	char		 path[PATH_MAX];
+	uint64_t	 t = now_ns();
+
+	if (t - spool.checked > SPOOL_CHECK_NS) {
+		snprintf(path, sizeof(path), "%s/todo", spool.dir);
+		spool.waiting = spool_count(path);
+		spool.checked = t;
+	}
+
+	return (spool.waiting < SPOOL_LOW);
+}
+
+
+/*
+ * Number of entries (tickets) in spool directory "path".
+ */
+static size_t
+spool_count(const char *path)
+{
+	DIR		*dirp = NULL;
+	struct dirent	*dp = NULL;
+	size_t		 n = 0;
+
+	if ((dirp = opendir(path)) == NULL)
+		error(1, errno, "Unable to open spool '%s'", path);
+	while ((dp = readdir(dirp)) != NULL)
+		n += !IS_DOT_OR_DOTDOT(dp->d_name);
+	closedir(dirp);
+
+	return (n);
+}
+
+
+/*
+ * Claim a ticket, waiting while there's none but some are being processed
+ * (they may push more).
+ * Returns the directory name (allocated), NULL when the scan is complete.
+ */
+static char *
+spool_claim(void)
+{
+	char		 todo[PATH_MAX], path[PATH_MAX], claimed[PATH_MAX];
+	char		*dir = NULL;
+	DIR		*dirp = NULL;
+	struct dirent	*dp = NULL;
+	FILE		*fp = NULL;
+	size_t		 len;
+
+	snprintf(todo, sizeof(todo), "%s/todo", spool.dir);
+	snprintf(claimed, sizeof(claimed), "%s/claimed", spool.dir);
+
+	for (;;) {
+		if ((dirp = opendir(todo)) == NULL)
+			error(1, errno, "Unable to open spool '%s'", todo);
+		while ((dp = readdir(dirp)) != NULL) {
+			if (IS_DOT_OR_DOTDOT(dp->d_name))
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s", todo,
+			    dp->d_name) >= (int) sizeof(path)
+			    || snprintf(claimed, sizeof(claimed),
+			    "%s/claimed/%s@%s", spool.dir, dp->d_name,
+			    spool.id) >= (int) sizeof(claimed))
+				continue;
+			/* Someone else was faster */
+			if (rename(path, claimed) == -1)
+				continue;
+			closedir(dirp);
+
+			if ((fp = fopen(claimed, "r")) == NULL
+			    || getdelim(&dir, &len, '\0', fp) <= 0)
+				error(1, errno, "Unable to read ticket '%s'",
+				    claimed);
+			fclose(fp);
+			free(spool.ticket);
+			if ((spool.ticket = strdup(claimed)) == NULL)
+				error(1, errno, "Unable to allocate ticket");
+			spool.renewed = 0;
+			spool_renew();
+			spool.claims++;
+			return (dir);
+		}
+		closedir(dirp);
+
+		spool_recover();
+		snprintf(claimed, sizeof(claimed), "%s/claimed", spool.dir);
+		if (spool_count(claimed) == 0 && spool_count(todo) == 0)
+			return (NULL);
+		nanosleep(&(struct timespec) { 0, SPOOL_POLL_NS }, NULL);
+	}
+}
+
+
+/*
+ * Renew the lease of the claimed ticket (at most every quarter of it).
+ */
+static void
+spool_renew(void)
+{
+	uint64_t	t = now_ns();
+
+	if (spool.ticket == NULL
+	    || t - spool.renewed < SPOOL_LEASE * 1000000000ULL / 4)
+		return;
+	if (utimensat(AT_FDCWD, spool.ticket, NULL, 0) == -1)
+		warning(errno, "Unable to renew ticket '%s'", spool.ticket);
+	spool.renewed = t;
+}
+
+
+/*
+ * Put back in "todo" the claimed tickets whose claimant died (on this
+ * host) or whose lease expired (the claimant is stuck, or died on
+ * another host).
+ */
+static void
+spool_recover(void)
+{
+	char		 claimed[PATH_MAX], path[PATH_MAX], todo[PATH_MAX];
+	char		*at = NULL, *dot = NULL;
+	DIR		*dirp = NULL;
+	struct dirent	*dp = NULL;
+	FIST_SSTAT	 st;
+	time_t		 now = time(NULL);
+	size_t		 hlen;
+	long		 pid;
+	int		 dead;
+
+	snprintf(claimed, sizeof(claimed), "%s/claimed", spool.dir);
+	if ((dirp = opendir(claimed)) == NULL)
+		error(1, errno, "Unable to open spool '%s'", claimed);
+	while ((dp = readdir(dirp)) != NULL) {
+		if ((at = strrchr(dp->d_name, '@')) == NULL
+		    || (dot = strrchr(at, '.')) == NULL
+		    || snprintf(path, sizeof(path), "%s/%s", claimed,
+		    dp->d_name) >= (int) sizeof(path)
+		    || FIST_LSTAT(path, &st) == -1)
+			continue;
+
+		hlen = (size_t) (dot - at - 1);
+		pid = strtol(dot + 1, NULL, 10);
+		dead = hlen == strlen(spool.host)
+		    && strncmp(at + 1, spool.host, hlen) == 0 && pid > 0
+		    && kill((pid_t) pid, 0) == -1 && errno == ESRCH;
+		if (!dead && now - st.st_mtime < SPOOL_LEASE)
+			continue;
+
+		/* Only one process can rename it */
+		snprintf(todo, sizeof(todo), "%s/todo/%.*s", spool.dir,
+		    (int) (at - dp->d_name), dp->d_name);
+		if (rename(path, todo) == 0)
+			warning(-1, "Ticket '%s' %s, put back", path,
+			    dead ? "of a dead process" : "lease expired");
+	}
+	closedir(dirp);
+}
+
+
+/*
+ * Traverse the directories of the tickets claimed until the scan is
+ * complete. The directories are opened from the root ("rootfd", on device
+ * "dev"): a directory which is (or is below) a mount point or a symlink is
+ * skipped.
+ */
+static int
+spool_run(const char *root, const int rootfd, const dev_t dev)
+{
+	const struct pnode	*pn = NULL;
+	struct dnode		*dir = NULL;
+	char			*path = NULL;
+	int			 r = 0, fd, project;
+
+	while ((path = spool_claim()) != NULL) {
+		/* Mount points are silently skipped */
+		if ((fd = open_beneath(rootfd, dev, root, path)) == -1
+		    && errno != EXDEV) {
+			warning(errno, "Unable to open directory '%s'", path);
+			r = -1;
+		}
+
+		if (fd != -1) {
+			pn = pnode_root(path, &project, 1);
+			dir = dnode_new(NULL, path, pn, project);
+			r |= dir_lookup(dev, fd, dir);
+			dnode_unref(dir);
+		}
+
+		/* Its sub-directories tickets are in "todo" */
+		if (unlink(spool.ticket) == -1)
+			warning(errno, "Unable to remove ticket '%s'",
+			    spool.ticket);
+		free(path);
+	}
+	free(spool.ticket);
+	spool.ticket = NULL;
+
+	return (r);
+}
+
+
+/*
+ * Open directory "path" (a full name, below "root", opened as "rootfd" on
+ * device "dev") component by component from the root with open_subdir():
+ * no symlink is followed (ELOOP) nor mount point crossed (EXDEV) anywhere
+ * below the root.
+ */
+static int
+open_beneath(const int rootfd, const dev_t dev, const char *root,
+    const char *path)
+{
+	char		*rel = NULL, *comp = NULL, *last = NULL;
+	size_t		 len = strlen(root);
+	int		 fd = rootfd, sfd, e;
+
+	if (strncmp(path, root, len) != 0 || (path[len] != '/'
+	    && path[len] != '\0' && (len == 0 || root[len - 1] != '/'))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((rel = strdup(path + len)) == NULL)
+		error(1, errno, "Unable to allocate directory name");
+
+	for (comp = strtok_r(rel, "/", &last); comp != NULL;
+	    comp = strtok_r(NULL, "/", &last)) {
+		if (strcmp(comp, ".") == 0)
+			continue;
+		if (strcmp(comp, "..") == 0) {
+			sfd = -1;
+			errno = EINVAL;
+		} else
+			sfd = open_subdir(fd, comp, dev, NULL);
+		e = errno;
+		if (fd != rootfd)
+			FS_CLOSE(fd);
+		if ((fd = sfd) == -1) {
+			free(rel);
+			errno = e;
+			return (-1);
+		}
+	}
+	free(rel);
+
+	/* The root itself */
+	if (fd == rootfd && (fd = FS_OPEN(root, O_RDONLY | O_DIRECTORY
+	    | O_CLOEXEC)) == -1)
+		return (-1);
+
+	return (fd);
+}
+
+
+/*
+ * --enumerate: phase 1 of a two-phase scan, the namespace of "root" is
+ * listed in "file" with directory reads only (no lstat(2), except for the
+ * objects of unknown type without d_type).
+ */
+static int
+list_write(const char *root, const char *file)
+{
+	struct arena	 arena;
+	FIST_SSTAT	 st;
+	FILE		*fp = NULL;
+	char		*buf = NULL;
+	size_t		 bufsize;
+	uint64_t	 ndirs = 0;
+	int		 fd, r;
+
+	if (strlen(root) > UINT16_MAX)
+		error(1, -1, "Name too long '%s'", root);
+	if ((fd = FS_OPEN(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		error(1, errno, "Unable to open directory '%s'", root);
+	if (FS_FSTAT(fd, &st) == -1)
+		error(1, errno, "Unable to stat '%s'", root);
+	if ((fp = fopen(file, "w")) == NULL)
+		error(1, errno, "Unable to open '%s'", file);
+	bufsize = budget_fit(FIST_LIST_BUFSIZE, BUDGET_MINBUF, BUDGET_BUFFERS);
+	if ((buf = malloc(bufsize)) == NULL)
+		error(1, errno, "Unable to allocate list buffer");
+	setvbuf(fp, buf, _IOFBF, bufsize);
+	if (fwrite(FIST_LIST_MAGIC, 8, 1, fp) != 1)
+		error(1, errno, "Unable to write '%s'", file);
+
+	memset(&arena, 0, sizeof(arena));
+	if ((r = list_dir(fp, st.st_dev, fd, 0, root, root, &arena, &ndirs)))
+		warning(-1, "A problem occurred while traversing '%s'", root);
+	arena_free(&arena);
+
+	if (fclose(fp) == EOF)
+		error(1, errno, "Unable to write '%s'", file);
+	budget_give(bufsize);
+	free(buf);
+	if (verbose)
+		fprintf(stderr, "fist: %s: %" PRIu64 " directories\n", file,
+		    ndirs);
+
+	return (r != 0);
+}
+
+
+/*
+ * List directory "fd" ("name", at "depth", full name "path"): its block
+ * (its record and its entries), then the blocks of its sub-directories,
+ * on device "dev".  The names of the sub-directories (and their full
+ * names) are in "arena" while the directory is listed.
+ */
+static int
+list_dir(FILE *fp, const dev_t dev, const int fd, const uint32_t depth,
+    const char *name, const char *path, struct arena *arena, uint64_t *ndirs)
+{
+	unsigned char		 rec[FIST_LIST_ELEN];
+	FIST_SSTAT		 st;
+	DIR			*dirp = NULL;
+	struct dirent		*dp = NULL;
+	struct arena_mark	 start, m;
+	char			**subs = NULL, **old = NULL, *sub = NULL;
+	size_t			 len, n = 0, size = 0, i;
+	int			 r = 0, sfd, isdir;
+
+	start = arena_mark(arena);
+	len = strlen(name);
+	rec[0] = 'D';
+	PUT32(rec + 1, depth);
+	rec[5] = (unsigned char) len;
+	rec[6] = (unsigned char) (len >> 8);
+	if (fwrite(rec, FIST_LIST_DLEN, 1, fp) != 1
+	    || fwrite(name, len, 1, fp) != 1)
+		error(1, errno, "Unable to write list");
+	(*ndirs)++;
+
+	if ((dirp = FS_FDOPENDIR(fd)) == NULL) {
+		warning(errno, "Unable to open directory '%s'", path);
+		FS_CLOSE(fd);
+		return (-1);
+	}
+
+	while ((dp = FS_READDIR(dirp)) != NULL) {
+		if (IS_DOT_OR_DOTDOT(dp->d_name))
+			continue;
+
+		isdir = -1;
+#ifdef DT_DIR
+		if (profile.dtype && dp->d_type != DT_UNKNOWN)
+			isdir = (dp->d_type == DT_DIR);
+#endif /* DT_DIR */
+		if (isdir == -1) {
+			if (FS_FSTATAT(fd, dp->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+				warning(errno, "Unable to lstat('%s/%s')",
+				    path, dp->d_name);
+				r = -1;
+				continue;
+			}
+			isdir = S_ISDIR(st.st_mode);
+		}
+
+		len = strlen(dp->d_name);
+		rec[0] = 'E';
+		PUT64(rec + 1, (uint64_t) dp->d_ino);
+		rec[9] = (unsigned char) isdir;
+		rec[10] = (unsigned char) len;
+		rec[11] = (unsigned char) (len >> 8);
+		if (fwrite(rec, FIST_LIST_ELEN, 1, fp) != 1
+		    || fwrite(dp->d_name, len, 1, fp) != 1)
+			error(1, errno, "Unable to write list");
+
+		/* Listed once this directory is complete */
+		if (isdir) {
+			if (n == size) {
+				size = size == 0 ? 64 : size * 2;
+				old = subs;
+				subs = arena_alloc(arena, size * sizeof(*subs));
+				if (n > 0)
+					memcpy(subs, old, n * sizeof(*subs));
+			}
+			subs[n++] = arena_strdup(arena, dp->d_name);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((sfd = open_subdir(fd, subs[i], dev, NULL)) == -1) {
+			/* Mount points are silently skipped */
+			if (errno != EXDEV) {
+				warning(errno, "Unable to open directory "
+				    "'%s/%s'", path, subs[i]);
+				r = -1;
+			}
+			continue;
+		}
+		m = arena_mark(arena);
+		sub = arena_alloc(arena, strlen(path) + strlen(subs[i]) + 2);
+		sprintf(sub, "%s/%s", path, subs[i]);
+		r |= list_dir(fp, dev, sfd, depth + 1, subs[i], sub, arena,
+		    ndirs);
+		arena_release(arena, &m);
+	}
+
+	if (FS_CLOSEDIR(dirp) == -1)
+		warning(errno, "Error while closing directory '%s'", path);
+	arena_release(arena, &start);
+
+	return (r);
+}
+
+
+/*
+ * --stat-list: open list "file" (written by --enumerate), returns the name
+ * of its root directory (allocated).  The blocks are read by list_stat().
+ */
+static char *
+list_load(const char *file)
+{
+	unsigned char	 rec[FIST_LIST_DLEN];
+	char		 magic[8], *root = NULL;
+	size_t		 len;
+
+	list.path = file;
+	if ((list.fp = fopen(file, "r")) == NULL)
+		error(1, errno, "Unable to open '%s'", file);
+	list.bufsize = budget_fit(FIST_LIST_BUFSIZE, BUDGET_MINBUF,
+	    BUDGET_BUFFERS);
+	if ((list.buf = malloc(list.bufsize)) == NULL)
+		error(1, errno, "Unable to allocate list buffer");
+	setvbuf(list.fp, list.buf, _IOFBF, list.bufsize);
+
+	if (fread(magic, sizeof(magic), 1, list.fp) != 1
+	    || memcmp(magic, FIST_LIST_MAGIC, sizeof(magic)) != 0)
+		error(1, -1, "'%s' is not a list", file);
+	list_get(rec, sizeof(rec));
+	len = GET16(rec + 5);
+	if (rec[0] != 'D' || GET32(rec + 1) != 0 || len == 0)
+		error(1, -1, "Invalid list '%s'", file);
+	if ((root = malloc(len + 1)) == NULL)
+		error(1, errno, "Unable to allocate directory name");
+	list_get(root, len);
+	root[len] = '\0';
+
+	return (root);
+}
+
+
+/*
+ * Phase 2 of a two-phase scan: lstat the entries of the list, read a
+ * directory block at a time, in batches handed to the thread pool (in
+ * inode order).  The directories of the path to the current one are kept
+ * open, from the root "dir" ("fd", closed here, on device "dev") with
+ * open_subdir().
+ */
+static int
+list_stat(const dev_t dev, const int fd, struct dnode *dir)
+{
+	unsigned char		 rec[FIST_LIST_ELEN];
+	char			 name[NAME_MAX + 1];
+	struct list_level	*levels = NULL, *l = NULL;
+	struct arena		*arena = &pool.arenas[0];
+	struct arena_mark	*marks = NULL;
+	struct dent		*ents = NULL, *e = NULL;
+	const struct pnode	*pn = NULL;
+	char			*path = NULL;
+	size_t			 size = 0, n = 0, len, cur = 0, depth;
+	int			 r = 0, type, project;
+
+	levels = grow(levels, &size, 0, sizeof(*levels));
+	levels[0].dir = dir;
+	levels[0].fd = fd;
+
+	for (;;) {
+		if ((type = getc(list.fp)) == 'E') {
+			list_get(rec + 1, FIST_LIST_ELEN - 1);
+			if ((len = GET16(rec + 10)) == 0 || len > NAME_MAX)
+				error(1, -1, "Invalid list '%s'", list.path);
+			if (n == 0) {
+				marks = pool_mark();
+				ents = arena_alloc(arena, profile.batch
+				    * sizeof(*ents));
+			}
+			e = &ents[n++];
+			e->name = arena_alloc(arena, len + 1);
+			list_get(e->name, len);
+			e->name[len] = '\0';
+			e->lname = NULL;
+			e->has_st = 0;
+			e->isdir = rec[9] != 0;
+			e->ino = (ino_t) GET64(rec + 1);
+			e->need_st = !names_only;
+			if (n == profile.batch) {
+				r |= list_batch(&levels[cur], ents, n);
+				pool_release(marks);
+				n = 0;
+			}
+			continue;
+		}
+
+		/* The end of the current directory block */
+		if (n > 0) {
+			r |= list_batch(&levels[cur], ents, n);
+			pool_release(marks);
+			n = 0;
+		}
+		if (type == EOF)
+			break;
+		if (type != 'D')
+			error(1, -1, "Invalid list '%s'", list.path);
+
+		/* A sub-directory of one of the directories of the path */
+		list_get(rec + 1, FIST_LIST_DLEN - 1);
+		depth = GET32(rec + 1);
+		if (depth == 0 || depth > cur + 1 || (len = GET16(rec + 5)) == 0
+		    || len > NAME_MAX)
+			error(1, -1, "Invalid list '%s'", list.path);
+		list_get(name, len);
+		name[len] = '\0';
+		for (; cur >= depth; cur--)
+			list_close(&levels[cur]);
+		levels = grow(levels, &size, depth, sizeof(*levels));
+		l = &levels[depth];
+		cur = depth;
+
+		/* A sub-directory may be the root of a project */
+		pn = NULL;
+		project = l[-1].dir->project;
+		if (l[-1].dir->pn != NULL
+		    && (pn = pnode_child(l[-1].dir->pn, name, 0)) != NULL
+		    && pn->project != -1)
+			project = pn->project;
+		l->dir = dnode_new(l[-1].dir, name, pn, project);
+
+		/* Not below a directory which couldn't be opened */
+		if ((l->fd = l[-1].fd) == -1)
+			continue;
+		if ((l->fd = open_subdir(l[-1].fd, name, dev, NULL)) == -1
+		    && errno != EXDEV) {
+			marks = pool_mark();
+			path = dnode_path(l->dir, arena);
+			warning(errno, "Unable to open directory '%s'", path);
+			pool_release(marks);
+			r = -1;
+		}
+	}
+	if (ferror(list.fp))
+		error(1, errno, "Unable to read '%s'", list.path);
+
+	for (; cur > 0; cur--)
+		list_close(&levels[cur]);
+	FS_CLOSE(fd);
+	budget_give(size * sizeof(*levels));
+	free(levels);
+	fclose(list.fp);
+	budget_give(list.bufsize);
+	free(list.buf);
+
+	return (r);
+}
+
+
+/*
+ * lstat and output a batch of "n" entries of directory "l" (nothing if it
+ * couldn't be opened).
+ */
+static int
+list_batch(const struct list_level *l, struct dent *ents, const size_t n)
+{
+	const struct pnode	*spn = NULL;
+	struct dent		*e = NULL;
+	char			*path = NULL;
+	size_t			 i;
+	uint64_t		 t;
+	int			 sproject;
+
+	if (l->fd == -1)
+		return (0);
+
+	t = TRACE_NOW();
+	path = dnode_path(l->dir, &pool.arenas[0]);
+	PROBE2(dir_entry, path, l->fd);
+	qsort(ents, n, sizeof(*ents), list_dent_cmp);
+	stat_batch(ents, n, l->fd, path);
+
+	for (i = 0; i < n; i++) {
+		e = &ents[i];
+		if (e->need_st && !e->has_st)
+			continue;	/* lstat(2) failed */
+
+		spn = NULL;
+		sproject = l->dir->project;
+		if (e->isdir && l->dir->pn != NULL
+		    && (spn = pnode_child(l->dir->pn, e->name, 0)) != NULL
+		    && spn->project != -1)
+			sproject = spn->project;
+
+		output(l->dir, e->name, names_only ? NULL : &e->st, e->lname,
+		    sproject);
+	}
+	trace_span(TRACE_DIR, 0, t, n, path, NULL);
+	PROBE3(dir_return, path, n, 0);
+
+	return (0);
+}
+
+
+/*
+ * Leave directory "l" of the path.
+ */
+static void
+list_close(struct list_level *l)
+{
+	if (l->fd != -1)
+		FS_CLOSE(l->fd);
+	dnode_unref(l->dir);
+}
+
+
+/*
+ * Read "len" bytes of the list.
+ */
+static void
+list_get(void *p, const size_t len)
+{
+	if (fread(p, len, 1, list.fp) != 1)
+		error(1, ferror(list.fp) ? errno : -1, "%s list '%s'",
+		    ferror(list.fp) ? "Unable to read" : "Truncated",
+		    list.path);
+}
+
+
+static int
+list_dent_cmp(const void *a, const void *b)
+{
+	const struct dent	*ea = a, *eb = b;
+
+	return (ea->ino < eb->ino ? -1 : (ea->ino > eb->ino));
+}
+
+
+/*
+ * Select the traversal profile: the one named in --fs-profile or the one
+ * of the filesystem of "dir" (the default one if unknown, or without
+ * "dir"), then apply the --fs-profile settings.
+ * --fs-profile is "[name|auto][,jobs=N,batch=N,bufsize=N,
+ * order=readdir|inode,dtype=0|1,leaf=0|1]".
+ */
+static void
+fs_profile_select(const char *dir)
+{
+	const struct fs_profile	*p = NULL;
+	FIST_SSTAT		 st;
+	char			*spec = NULL, *opt = NULL, *val = NULL;
+	char			*next = NULL, *name = NULL;
+	size_t			 len;
+#ifndef FIST_SIMFS
+	long			 type = 0;
+#endif /* !FIST_SIMFS */
+#if defined(__linux__) && !defined(FIST_SIMFS)
+	struct statfs		 sfs;
+#endif /* __linux__ && !FIST_SIMFS */
+
+	if (profile_arg != NULL) {
+		if ((spec = strdup(profile_arg)) == NULL)
+			error(1, errno, "Unable to allocate profile");
+		next = spec;
+		len = strcspn(spec, ",");
+		if (memchr(spec, '=', len) == NULL) {
+			name = spec;
+			next = spec[len] != '\0' ? spec + len + 1 : NULL;
+			spec[len] = '\0';
+		}
+	}
+
+	if (name != NULL && strcmp(name, "auto") != 0) {
+		for (p = fs_profiles; p->name != NULL; p++)
+			if (strcmp(p->name, name) == 0)
+				break;
+		if (p->name == NULL)
+			error(1, -1, "Unknown filesystem profile '%s'", name);
+	} else {
+#if defined(FIST_SIMFS)
+		for (p = fs_profiles; strcmp(p->name, "simfs") != 0; p++)
+			;
+		(void) dir;
+#else
+# ifdef __linux__
+		if (dir != NULL && statfs(dir, &sfs) == 0)
+			type = (long) sfs.f_type;
+# endif /* __linux__ */
+		/* The default profile if the type is unknown */
+		for (p = fs_profiles; p->magic != 0 && p->magic != type; p++)
+			;
+#endif /* FIST_SIMFS */
+	}
+	profile = *p;
+
+	while ((opt = next) != NULL) {
+		if ((next = strchr(opt, ',')) != NULL)
+			*next++ = '\0';
+		if ((val = strchr(opt, '=')) == NULL)
+			error(1, -1, "Invalid profile setting '%s'", opt);
+		*val++ = '\0';
+		if (strcmp(opt, "jobs") == 0) {
+			profile.jobs_max = (unsigned) parse_number(opt, val);
+			profile.jobs_per_cpu = profile.jobs_max;
+			if (profile.jobs_max == 0 || profile.jobs_max > 1024)
+				error(1, -1, "Invalid number of jobs '%s'",
+				    val);
+		} else if (strcmp(opt, "batch") == 0) {
+			if ((profile.batch = parse_number(opt, val)) == 0)
+				error(1, -1, "Invalid batch size '%s'", val);
+		} else if (strcmp(opt, "bufsize") == 0)
+			profile.bufsize = parse_number(opt, val);
+		else if (strcmp(opt, "order") == 0) {
+			if (strcmp(val, "readdir") == 0)
+				profile.order = ORDER_READDIR;
+			else if (strcmp(val, "inode") == 0)
+				profile.order = ORDER_INODE;
+			else
+				error(1, -1, "Invalid order '%s'", val);
+		} else if (strcmp(opt, "dtype") == 0)
+			profile.dtype = parse_number(opt, val) != 0;
+		else if (strcmp(opt, "leaf") == 0)
+			profile.leaf = parse_number(opt, val) != 0;
+		else
+			error(1, -1, "Unknown profile setting '%s'", opt);
+	}
+	free(spec);
+
+	/* Inode order only helps when seeks are expensive */
+	if (profile.order == ORDER_INODE_HDD)
+		profile.order = dir != NULL && FS_LSTAT(dir, &st) == 0
+		    && is_rotational(st.st_dev) ? ORDER_INODE : ORDER_READDIR;
+}
+
+
+/*
+ * Whether device "dev" (or the disk of this partition) is rotational.
+ */
+static int
+is_rotational(const dev_t dev)
+{
+#ifdef __linux__
+	char	 path[PATH_MAX];
+	FILE	*fp = NULL;
+	int	 r = 0, i;
+
+	for (i = 0; i < 2 && fp == NULL; i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s"
+		    "queue/rotational", major(dev), minor(dev),
+		    i == 0 ? "" : "../");
+		fp = fopen(path, "r");
+	}
+	if (fp == NULL)
+		return (0);
+	if (fscanf(fp, "%d", &r) != 1)
+		r = 0;
+	fclose(fp);
+
+	return (r == 1);
+#else
+	(void) dev;
+	return (0);
+#endif /* __linux__ */
+}
+
+
+/*
+ * lstat order of the entries of a batch to lstat: by inode number.
+ */
+static void
+stat_order(struct dent *ents, const size_t n, struct arena *arena)
+{
+	size_t	 i;
+
+	pool.order = arena_alloc(arena, n * sizeof(*pool.order));
+	for (i = 0; i < n; i++)
+		pool.order[i] = i;
+	pool.ents = ents;
+	qsort(pool.order, n, sizeof(*pool.order), dent_ino_cmp);
+}
+
+
+static int
+dent_ino_cmp(const void *a, const void *b)
+{
+	const struct dent	*ea = &pool.ents[*(const size_t *) a];
+	const struct dent	*eb = &pool.ents[*(const size_t *) b];
+
+	return (ea->ino < eb->ino ? -1 : (ea->ino > eb->ino));
+}
+
+
+/*
+ * Open directory "name" (in directory "dfd") for traversal.
+ * With openat2(2), the kernel rejects mount point crossings and symlinks
+ * in the very call opening the directory, so a directory replaced (by a
+ * symlink or a mount) after it was lstat'ed cannot be followed and no
+ * extra stat is required.
+ * Otherwise, openat(2) with O_NOFOLLOW is used and the device is checked
+ * with fstat(2) afterwards.
+ * O_NOATIME is used when permitted (owner or root) to avoid atime updates
+ * of directories (a write-back on the metadata servers of some
+ * filesystems).
+ * "st" is the lstat(2) result for "name", if known.
+ * Returns a file descriptor or -1 (with errno set, EXDEV for mount points).
+ */
+static int
+open_subdir(const int dfd, const char *name, const dev_t dev,
+    const FIST_SSTAT *st)
+{
+	FIST_SSTAT	 fst;
+	int		 fd = -1, flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+			    | O_CLOEXEC;
+#ifdef HAS_OPENAT2
+	static int	 has_openat2 = 1;
+	struct open_how	 how;
+#endif /* HAS_OPENAT2 */
+
+	if (O_NOATIME != 0 && (euid == 0 || (st != NULL && st->st_uid == euid)))
+		flags |= O_NOATIME;
+
+#ifdef HAS_OPENAT2
+	if (has_openat2) {
+		memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		how.resolve = RESOLVE_NO_XDEV | RESOLVE_NO_SYMLINKS
+		    | RESOLVE_BENEATH;
+		fd = syscall(SYS_openat2, dfd, name, &how, sizeof(how));
+		if (fd == -1 && errno == EPERM && (flags & O_NOATIME)) {
+			how.flags &= ~O_NOATIME;
+			fd = syscall(SYS_openat2, dfd, name, &how, sizeof(how));
+		}
+		if (fd != -1 || errno != ENOSYS)
+			return (fd);
+		/* Kernel older than 5.6 */
+		has_openat2 = 0;
+	}
+#endif /* HAS_OPENAT2 */
+
+	if ((fd = FS_OPENAT(dfd, name, flags)) == -1 && errno == EPERM
+	    && (flags & O_NOATIME))
+		fd = FS_OPENAT(dfd, name, flags & ~O_NOATIME);
+	if (fd == -1)
+		return (-1);
+
+	if (FS_FSTAT(fd, &fst) == -1)
+		fst.st_dev = dev + 1;
+	if (fst.st_dev != dev) {
+		FS_CLOSE(fd);
+		errno = EXDEV;
+		return (-1);
+	}
+
+	return (fd);
+}
+
+
+void
+print_metadata(FILE *fp, const struct fist_obj *o)
+{
+	const FIST_SSTAT	*st = o->st;
+	unsigned char		*c = NULL;
+
+	/*
+	 * Don't print '.' and '..' for the non-root directories.
+	 */
+	if (S_ISDIR(st->st_mode) && o->parent != NULL
+	    && IS_DOT_OR_DOTDOT(o->name))
+		return;
+
+	fprintf(fp, "%u:%o:%u:%u:%u:%" PRIu64 ":%u:%u:%u:",
+	    (unsigned int) ((st->st_blocks + 1) >> 1),
+	    (unsigned int) st->st_mode, (unsigned int) st->st_nlink,
+	    (unsigned int) st->st_uid, (unsigned int) st->st_gid,
+	    (uint64_t) st->st_size, (unsigned int) st->st_mtime,
+	    (unsigned int) st->st_atime, (unsigned int) st->st_ctime);
+
+	print_name(fp, o->name, o->parent);
+
+	if (S_ISLNK(st->st_mode)) {
+		fputs(" -> ", fp);
+		for (c = (unsigned char *) o->lname; c != NULL && *c != '\0';
+		    c++)
+			print_percent_encoded_char(*c, fp);
+	}
+
+	fputc('\n', fp);
+}
+
+
+/*
+ * Value of symlink "name" (in directory "dfd") read in "lnvalue" (of size
+ * PATH_MAX), an empty string if it can't be read.
+ */
+static const char *
+read_link(const int dfd, const char *name, const char *fullname,
+    char *lnvalue)
+{
+	ssize_t		 lnlen = -1;
+
+	PROBE1(readlink_entry, name);
+	lnlen = FS_READLINKAT(dfd, name, lnvalue, PATH_MAX - 1);
+	PROBE2(readlink_return, name, lnlen);
+	if (lnlen == -1) {
+		warning(errno, "Unable to readlink(2) '%s'", fullname);
+	}
+	if (lnlen < 0)
+		lnlen = 0;
+	lnvalue[lnlen] = '\0';
+
+	return (lnvalue);
+}
+
+
+/*
+ * Print the percent-encoded full name of an object (without a newline).
+ */
+void
+print_name(FILE *fp, const char *name, const char *parent)
+{
+	unsigned char	*c = NULL;
+
+	if (parent != NULL) {
+		for (c = (unsigned char *) parent; c != NULL && *c != '\0'; c++)
+			print_percent_encoded_char(*c, fp);
+		fputc('/', fp);
+	}
+
+	for (c = (unsigned char *) name; c != NULL && *c != '\0'; c++)
+		print_percent_encoded_char(*c, fp);
+}
+
+
+int
+print_percent_encoded_char(const char c, FILE* fp)
+{
+	if (fist_encoded((unsigned char) c))
+		return (fprintf(fp, "%%%02hhX", (unsigned char) c));
+	return (fputc(c, fp));
+}
+
+
+/*
+ * Add an output from its command line description:
+ *   "type[,option=value...]:path"
+ */
+static void
+add_sink(const char *arg)
+{
+	const struct sink_type	*t = NULL;
+	struct sink		*s = NULL, **sp = NULL;
+	char			*spec = NULL, *path = NULL, *opt = NULL;
+	char			*val = NULL, *next = NULL;
+
+	if ((spec = strdup(arg)) == NULL || (s = calloc(1, sizeof(*s))) == NULL)
+		error(1, errno, "Unable to allocate output");
+
+	if ((path = strchr(spec, ':')) == NULL || path[1] == '\0')
+		error(1, -1, "Invalid output '%s' (no file)", arg);
+	*path++ = '\0';
+	s->path = path;
+	s->maxfiles = PART_MAXFILES;
+	s->filter.uid = s->filter.gid = -1;
+
+	if ((next = strchr(spec, ',')) != NULL)
+		*next++ = '\0';
+	for (t = sink_types; t->name != NULL; t++)
+		if (strcmp(t->name, spec) == 0)
+			break;
+	if (t->name == NULL)
+		error(1, -1, "Unknown output type '%s'", spec);
+	s->type = t;
+	s->bufsize = t->bufsize;
+
+	while ((opt = next) != NULL) {
+		if ((next = strchr(opt, ',')) != NULL)
+			*next++ = '\0';
+		if ((val = strchr(opt, '=')) == NULL)
+			error(1, -1, "Invalid output option '%s'", opt);
+		*val++ = '\0';
+
+		if (strcmp(opt, "bufsize") == 0) {
+			s->bufsize = parse_number(opt, val);
+			s->bufsize_set = 1;
+			continue;
+		}
+		if (strcmp(opt, "index") == 0 && (t->emit == text_emit
+		    || t->emit == bin_emit)) {
+			if ((s->index_block = parse_number(opt, val)) == 0)
+				error(1, -1, "Invalid value '%s' for '%s'",
+				    val, opt);
+			continue;
+		}
+		if (strcmp(opt, "maxfiles") == 0 && t->open == parts_open) {
+			if ((s->maxfiles = parse_number(opt, val)) == 0)
+				error(1, -1, "Invalid value '%s' for '%s'",
+				    val, opt);
+			continue;
+		}
+
+		s->filter.active = 1;
+		if (strcmp(opt, "minsize") == 0)
+			s->filter.minsize = parse_number(opt, val);
+		else if (strcmp(opt, "maxsize") == 0)
+			s->filter.maxsize = parse_number(opt, val);
+		else if (strcmp(opt, "olderthan") == 0)
+			s->filter.mtime_before = time(NULL)
+			    - (time_t) parse_number(opt, val) * 86400;
+		else if (strcmp(opt, "newerthan") == 0)
+			s->filter.mtime_after = time(NULL)
+			    - (time_t) parse_number(opt, val) * 86400;
+		else if (strcmp(opt, "uid") == 0)
+			s->filter.uid = (long) parse_number(opt, val);
+		else if (strcmp(opt, "gid") == 0)
+			s->filter.gid = (long) parse_number(opt, val);
+		else if (strcmp(opt, "type") == 0) {
+			switch (val[0] != '\0' && val[1] == '\0' ? val[0] : 0) {
+			case 'f':
+				s->filter.type = S_IFREG;
+				break;
+			case 'd':
+				s->filter.type = S_IFDIR;
+				break;
+			case 'l':
+				s->filter.type = S_IFLNK;
+				break;
+			default:
+				error(1, -1, "Invalid object type '%s'", val);
+			}
+		} else
+			error(1, -1, "Unknown output option '%s'", opt);
+	}
+
+	/* Keep the command line order */
+	for (sp = &sinks; *sp != NULL; sp = &(*sp)->next)
+		;
+	*sp = s;
+}
+
+
+/*
+ * Parse a number with an optional binary multiplier suffix (K, M, G, T).
+ */
+static uint64_t
+parse_number(const char *name, const char *val)
+{
+	char		*end = NULL;
+	uint64_t	 n;
+
+	errno = 0;
+	n = strtoull(val, &end, 10);
+	if (errno != 0 || end == val)
+		error(1, -1, "Invalid value '%s' for '%s'", val, name);
+
+	switch (*end) {
+	case 'T':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'G':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'M':
+		n <<= 10;
+		/* FALLTHROUGH */
+	case 'K':
+		n <<= 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+	if (*end != '\0')
+		error(1, -1, "Invalid value '%s' for '%s'", val, name);
+
+	return (n);
+}
+
+
+static int
+filter_match(const struct filter *f, const struct fist_obj *o)
+{
+	const FIST_SSTAT	*st = o->st;
+
+	if (!f->active)
+		return (1);
+
+	if (f->type != 0 && (st->st_mode & S_IFMT) != f->type)
+		return (0);
+	if (f->uid != -1 && (long) st->st_uid != f->uid)
+		return (0);
+	if (f->gid != -1 && (long) st->st_gid != f->gid)
+		return (0);
+	if (f->minsize != 0 && (uint64_t) st->st_size < f->minsize)
+		return (0);
+	if (f->maxsize != 0 && (uint64_t) st->st_size > f->maxsize)
+		return (0);
+	if (f->mtime_before != 0 && st->st_mtime >= f->mtime_before)
+		return (0);
+	if (f->mtime_after != 0 && st->st_mtime < f->mtime_after)
+		return (0);
+
+	return (1);
+}
+
+
+/*
+ * ext4 image scan (--ext4-image): instead of a traversal through the VFS
+ * (one random read per inode and directory), the inode tables of the image
+ * are read sequentially (in use inodes are kept, sorted by number), then
+ * the directory (and long symlinks) blocks, sorted by block number.
+ * The tree is then rebuilt from the directory entries and the objects are
+ * output with "dir" (the mount point of the image) as root.
+ * ext2, ext3 and ext4 images are supported, except with "meta_bg".
+ */
+static int
+ext4_scan(const char *image, const char *dir, const struct pnode *pn,
+    const int project)
+{
+	struct ext4_fs		 fs;
+	struct ext4_inode	*ino = NULL;
+	FIST_SSTAT		 st;
+	unsigned char		 sb[1024];
+	uint64_t		 nblocks, g;
+	uint32_t		 bpg, first;
+	size_t			 i;
+	int			 r;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.image = image;
+	if ((fs.fd = open(image, O_RDONLY | O_CLOEXEC)) == -1)
+		error(1, errno, "Unable to open image '%s'", image);
+#ifdef POSIX_FADV_SEQUENTIAL
+	(void) posix_fadvise(fs.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* Superblock */
+	ext4_read(&fs, sb, sizeof(sb), 1024);
+	if (GET16(sb + 56) != EXT4_MAGIC)
+		error(1, -1, "'%s' is not an ext2/3/4 image", image);
+	fs.bsize = 1024U << GET32(sb + 24);
+	fs.ipg = GET32(sb + 40);
+	bpg = GET32(sb + 32);
+	first = GET32(sb + 20);
+	fs.incompat = GET32(sb + 96);
+	fs.rocompat = GET32(sb + 100);
+	fs.isize = GET32(sb + 76) == 0 ? 128 : GET16(sb + 88);
+	nblocks = GET32(sb + 4);
+	fs.descsize = 32;
+	if (fs.incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		nblocks |= (uint64_t) GET32(sb + 336) << 32;
+		if (GET16(sb + 254) > 32)
+			fs.descsize = GET16(sb + 254);
+	}
+	if (fs.incompat & EXT4_FEATURE_INCOMPAT_META_BG)
+		error(1, -1, "'%s': \"meta_bg\" images are not supported",
+		    image);
+	if (fs.bsize > 65536 || bpg == 0 || fs.ipg == 0 || fs.isize < 128
+	    || fs.isize > fs.bsize || nblocks <= first)
+		error(1, -1, "'%s': invalid superblock", image);
+	fs.nblocks = nblocks;
+	fs.ngroups = (nblocks - first + bpg - 1) / bpg;
+
+	/* Group descriptors, just after the superblock */
+	if ((fs.gdt = malloc(fs.ngroups * fs.descsize)) == NULL)
+		error(1, errno, "Unable to allocate ext4 descriptors");
+	ext4_read(&fs, fs.gdt, fs.ngroups * fs.descsize,
+	    (uint64_t) (first + 1) * fs.bsize);
+
+	/* Inode tables, sequentially */
+	for (g = 0; g < fs.ngroups; g++)
+		ext4_itable(&fs, g);
+
+	/* Directories and symlinks blocks, in block order */
+	qsort(fs.blks, fs.nblks, sizeof(*fs.blks), ext4_blk_cmp);
+	ext4_blocks(&fs);
+	qsort(fs.dents, fs.ndents, sizeof(*fs.dents), ext4_dent_cmp);
+	for (i = fs.ndents; i > 0; i--) {
+		fs.dirs[fs.dents[i - 1].dir].first = i - 1;
+		fs.dirs[fs.dents[i - 1].dir].count++;
+	}
+
+	if ((ino = ext4_inode_find(&fs, EXT4_ROOT_INO)) == NULL
+	    || ino->dir == 0)
+		error(1, -1, "'%s': no root directory", image);
+	ext4_stat(ino, &st);
+	output(NULL, dir, names_only ? NULL : &st, NULL, project);
+	r = ext4_tree(&fs, dnode_new(NULL, dir, pn, project), ino->dir - 1);
+
+	if (verbose)
+		fprintf(stderr, "fist: %s: %zu inodes, %zu directories, "
+		    "%zu entries, %" PRIu64 " MiB read\n", image, fs.ninodes,
+		    fs.ndirs, fs.ndents, fs.bytes_read >> 20);
+
+	close(fs.fd);
+	free(fs.gdt);
+	free(fs.inodes);
+	free(fs.dirs);
+	free(fs.dents);
+	free(fs.blks);
+	budget_give(fs.inodes_size * sizeof(*fs.inodes) + fs.dirs_size
+	    * sizeof(*fs.dirs) + fs.dents_size * sizeof(*fs.dents)
+	    + fs.blks_size * sizeof(*fs.blks));
+
+	return (r);
+}
+
+
+static void
+ext4_read(struct ext4_fs *fs, void *buf, const size_t len,
+    const uint64_t off)
+{
+	ssize_t	n;
+	size_t	done;
+
+	for (done = 0; done < len; done += (size_t) n) {
+		if ((n = pread(fs->fd, (char *) buf + done, len - done,
+		    (off_t) (off + done))) == -1)
+			error(1, errno, "Unable to read image '%s'", fs->image);
+		if (n == 0)
+			error(1, -1, "'%s': truncated image", fs->image);
+	}
+	fs->bytes_read += len;
+}
+
+
+/*
+ * Grow an array (of "n" elements of "elsize" bytes, "*size" allocated) to
+ * hold one more.
+ */
+static void *
+grow(void *p, size_t *size, const size_t n, const size_t elsize)
+{
+	if (n < *size)
+		return (p);
+	budget_take((*size == 0 ? 1024 : *size) * elsize, 1);
+	*size = *size == 0 ? 1024 : *size * 2;
+	if ((p = realloc(p, *size * elsize)) == NULL)
+		error(1, errno, "Unable to allocate memory");
+	return (p);
+}
+
+
+/*
+ * Read the inode table of group "g", keep the in use inodes.
+ */
+static void
+ext4_itable(struct ext4_fs *fs, const uint64_t g)
+{
+	const unsigned char	*gd = fs->gdt + g * fs->descsize;
+	unsigned char		*buf = NULL, *raw = NULL;
+	struct ext4_inode	*ino = NULL;
+	struct ext4_dir		*d = NULL;
+	uint64_t		 itable;
+	uint32_t		 n, unused, i, j, chunk, flags;
+	size_t			 len;
+	int			 csum;
+
+	csum = (fs->rocompat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM
+	    | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+	n = fs->ipg;
+	if (csum) {
+		if (GET16(gd + 18) & EXT4_BG_INODE_UNINIT)
+			return;
+		unused = GET16(gd + 28);
+		if (fs->descsize >= 64)
+			unused |= (uint32_t) GET16(gd + 50) << 16;
+		n = unused < n ? n - unused : 0;
+	}
+	itable = GET32(gd + 8);
+	if (fs->descsize >= 64)
+		itable |= (uint64_t) GET32(gd + 40) << 32;
+	if (n == 0)
+		return;
+	if (itable == 0 || itable >= fs->nblocks) {
+		warning(-1, "'%s': invalid inode table for group %" PRIu64,
+		    fs->image, g);
+		return;
+	}
+
+	chunk = EXT4_READ_SIZE / fs->isize;
+	if ((buf = malloc((size_t) chunk * fs->isize)) == NULL)
+		error(1, errno, "Unable to allocate ext4 buffer");
+	for (i = 0; i < n; i += chunk) {
+		if (chunk > n - i)
+			chunk = n - i;
+		len = (size_t) chunk * fs->isize;
+		ext4_read(fs, buf, len, itable * fs->bsize
+		    + (uint64_t) i * fs->isize);
+
+		for (j = 0; j < chunk; j++) {
+			raw = buf + (size_t) j * fs->isize;
+			if (GET16(raw) == 0 || GET16(raw + 26) == 0)
+				continue;	/* free */
+
+			fs->inodes = grow(fs->inodes, &fs->inodes_size,
+			    fs->ninodes, sizeof(*fs->inodes));
+			ino = &fs->inodes[fs->ninodes++];
+			ext4_inode_parse(fs, ino, raw,
+			    (uint32_t) (g * fs->ipg + i + j + 1));
+			flags = GET32(raw + 32);
+
+			if (S_ISDIR(ino->mode)) {
+				fs->dirs = grow(fs->dirs, &fs->dirs_size,
+				    fs->ndirs, sizeof(*fs->dirs));
+				d = &fs->dirs[fs->ndirs++];
+				memset(d, 0, sizeof(*d));
+				d->inode = fs->ninodes - 1;
+				ino->dir = (uint32_t) fs->ndirs;
+				if (flags & EXT4_INLINE_DATA_FL)
+					ext4_dirblock(fs, raw + 44, 56,
+					    fs->ndirs - 1, 0);
+				else
+					ext4_map(fs, raw + 40, flags,
+					    fs->ninodes - 1, ino->size);
+			} else if (S_ISLNK(ino->mode)) {
+				len = ino->size < PATH_MAX ? ino->size
+				    : PATH_MAX - 1;
+				ino->lname = arena_alloc(&fs->arena, len + 1);
+				memset(ino->lname, 0, len + 1);
+				if ((flags & EXT4_INLINE_DATA_FL) || (len < 60
+				    && !(flags & EXT4_EXTENTS_FL)))
+					memcpy(ino->lname, raw + 40,
+					    len < 60 ? len : 60);
+				else
+					ext4_map(fs, raw + 40, flags,
+					    fs->ninodes - 1, len);
+			}
+		}
+	}
+	free(buf);
+}
+
+
+static void
+ext4_inode_parse(const struct ext4_fs *fs, struct ext4_inode *ino,
+    const unsigned char *raw, const uint32_t number)
+{
+	uint32_t	extra = 0;
+
+	memset(ino, 0, sizeof(*ino));
+	ino->ino = number;
+	ino->mode = GET16(raw);
+	ino->uid = GET16(raw + 2) | (uint32_t) GET16(raw + 120) << 16;
+	ino->gid = GET16(raw + 24) | (uint32_t) GET16(raw + 122) << 16;
+	ino->nlink = GET16(raw + 26);
+	ino->size = GET32(raw + 4) | (uint64_t) GET32(raw + 108) << 32;
+	ino->blocks = GET32(raw + 28);
+	if (fs->rocompat & EXT4_FEATURE_RO_COMPAT_HUGE_FILE) {
+		ino->blocks |= (uint64_t) GET16(raw + 116) << 32;
+		if (GET32(raw + 32) & EXT4_HUGE_FILE_FL)
+			ino->blocks *= fs->bsize / 512;
+	}
+
+	/* Dates after 2038 use 2 more bits in the large inodes */
+	if (fs->isize > 128)
+		extra = GET16(raw + 128);
+	ino->ctime = (int32_t) GET32(raw + 12);
+	ino->mtime = (int32_t) GET32(raw + 16);
+	ino->atime = (int32_t) GET32(raw + 8);
+	if (extra >= 8)
+		ino->ctime += (int64_t) (GET32(raw + 132) & 3) << 32;
+	if (extra >= 12)
+		ino->mtime += (int64_t) (GET32(raw + 136) & 3) << 32;
+	if (extra >= 16)
+		ino->atime += (int64_t) (GET32(raw + 140) & 3) << 32;
+}
+
+
+/*
+ * Queue the blocks (up to "size" bytes) of inode number "idx" (extents or
+ * ext2/3 block map in "iblock"), for ext4_blocks().
+ */
+static void
+ext4_map(struct ext4_fs *fs, const unsigned char *iblock,
+    const uint32_t flags, const size_t idx, const uint64_t size)
+{
+	uint64_t	nlblk = (size + fs->bsize - 1) / fs->bsize;
+	uint64_t	lblk = 0;
+	int		i;
+
+	if (flags & EXT4_EXTENTS_FL) {
+		ext4_extents(fs, iblock, idx, nlblk, 0);
+		return;
+	}
+
+	/* 12 direct blocks, then single, double and triple indirect */
+	for (i = 0; i < 12 && lblk < nlblk; i++, lblk++)
+		ext4_blk_add(fs, GET32(iblock + 4 * i), idx, lblk);
+	for (i = 0; i < 3 && lblk < nlblk; i++)
+		ext4_indirect(fs, GET32(iblock + 48 + 4 * i), i, idx, &lblk,
+		    nlblk);
+}
+
+
+static void
+ext4_extents(struct ext4_fs *fs, const unsigned char *node, const size_t idx,
+    const uint64_t nlblk, const int level)
+{
+	unsigned char	*buf = NULL;
+	const unsigned char *e = NULL;
+	uint64_t	 pblk, lblk;
+	uint32_t	 len, j;
+	uint16_t	 n, depth, i;
+
+	if (GET16(node) != EXT4_EXT_MAGIC || level > 5) {
+		warning(-1, "'%s': invalid extents for inode %" PRIu32,
+		    fs->image, fs->inodes[idx].ino);
+		return;
+	}
+	n = GET16(node + 2);
+	depth = GET16(node + 6);
+
+	for (i = 0; i < n; i++) {
+		e = node + 12 + 12 * i;
+		if (depth == 0) {
+			lblk = GET32(e);
+			len = GET16(e + 4);
+			if (len > 32768)	/* not initialized */
+				continue;
+			pblk = (uint64_t) GET16(e + 6) << 32 | GET32(e + 8);
+			for (j = 0; j < len && lblk + j < nlblk; j++)
+				ext4_blk_add(fs, pblk + j, idx, lblk + j);
+			continue;
+		}
+
+		/* Index node: the leaves are in other blocks */
+		pblk = (uint64_t) GET16(e + 8) << 32 | GET32(e + 4);
+		if (pblk == 0 || pblk >= fs->nblocks)
+			continue;
+		if (buf == NULL && (buf = malloc(fs->bsize)) == NULL)
+			error(1, errno, "Unable to allocate ext4 buffer");
+		ext4_read(fs, buf, fs->bsize, pblk * fs->bsize);
+		ext4_extents(fs, buf, idx, nlblk, level + 1);
+	}
+	free(buf);
+}
+
+
+static void
+ext4_indirect(struct ext4_fs *fs, const uint32_t pblk, const int level,
+    const size_t idx, uint64_t *lblk, const uint64_t nlblk)
+{
+	uint32_t	*buf = NULL;
+	uint32_t	 i, n = fs->bsize / 4, span = 1;
+	int		 l;
+
+	for (l = 0; l < level; l++)
+		span *= n;
+	if (pblk == 0 || pblk >= fs->nblocks) {
+		*lblk += (uint64_t) span * n;	/* hole */
+		return;
+	}
+	if ((buf = malloc(fs->bsize)) == NULL)
+		error(1, errno, "Unable to allocate ext4 buffer");
+	ext4_read(fs, buf, fs->bsize, (uint64_t) pblk * fs->bsize);
+	for (i = 0; i < n && *lblk < nlblk; i++) {
+		if (level == 0)
+			ext4_blk_add(fs, GET32((unsigned char *) &buf[i]), idx,
+			    (*lblk)++);
+		else
+			ext4_indirect(fs, GET32((unsigned char *) &buf[i]),
+			    level - 1, idx, lblk, nlblk);
+	}
+	free(buf);
+}
+
+
+static void
+ext4_blk_add(struct ext4_fs *fs, const uint64_t pblk, const size_t idx,
+    const uint64_t lblk)
+{
+	struct ext4_blk	*b = NULL;
+
+	if (pblk == 0 || pblk >= fs->nblocks)
+		return;		/* hole */
+	fs->blks = grow(fs->blks, &fs->blks_size, fs->nblks,
+	    sizeof(*fs->blks));
+	b = &fs->blks[fs->nblks++];
+	b->pblk = pblk;
+	b->inode = (uint32_t) idx;
+	b->lblk = (uint32_t) lblk;
+}
+
+
+/*
+ * Read the queued blocks (sorted), consecutive blocks at once.
+ */
+static void
+ext4_blocks(struct ext4_fs *fs)
+{
+	struct ext4_inode	*ino = NULL;
+	unsigned char		*buf = NULL, *blk = NULL;
+	size_t			 i, j, n, max, len;
+	uint64_t		 off;
+
+	max = EXT4_READ_SIZE / fs->bsize;
+	if ((buf = malloc(max * fs->bsize)) == NULL)
+		error(1, errno, "Unable to allocate ext4 buffer");
+
+	for (i = 0; i < fs->nblks; i += n) {
+		for (n = 1; n < max && i + n < fs->nblks
+		    && fs->blks[i + n].pblk <= fs->blks[i + n - 1].pblk + 1
+		    && fs->blks[i + n].pblk - fs->blks[i].pblk < max; n++)
+			;
+		ext4_read(fs, buf, (fs->blks[i + n - 1].pblk - fs->blks[i].pblk
+		    + 1) * fs->bsize, fs->blks[i].pblk * fs->bsize);
+
+		for (j = i; j < i + n; j++) {
+			blk = buf + (fs->blks[j].pblk - fs->blks[i].pblk)
+			    * fs->bsize;
+			ino = &fs->inodes[fs->blks[j].inode];
+			if (ino->dir != 0) {
+				ext4_dirblock(fs, blk, fs->bsize, ino->dir - 1,
+				    fs->blks[j].lblk);
+				continue;
+			}
+			/* Symlink value */
+			off = (uint64_t) fs->blks[j].lblk * fs->bsize;
+			len = ino->size < PATH_MAX ? ino->size : PATH_MAX - 1;
+			if (off < len)
+				memcpy(ino->lname + off, blk, len - off
+				    < fs->bsize ? len - off : fs->bsize);
+		}
+	}
+	free(buf);
+}
+
+
+/*
+ * Directory entries of a directory block (or inline directory).
+ * The htree index blocks look like empty blocks, they are skipped.
+ */
+static void
+ext4_dirblock(struct ext4_fs *fs, const unsigned char *blk, const size_t len,
+    const size_t dir, const uint32_t lblk)
+{
+	struct ext4_dent	*e = NULL;
+	char			 name[256];
+	size_t			 off, reclen, namelen;
+
+	for (off = 0; off + 8 <= len; off += reclen) {
+		reclen = GET16(blk + off + 4);
+		namelen = blk[off + 6];
+		if (reclen < 8 || off + reclen > len || namelen + 8 > reclen) {
+			warning(-1, "'%s': invalid directory entry in "
+			    "directory inode %" PRIu32, fs->image,
+			    fs->inodes[fs->dirs[dir].inode].ino);
+			return;
+		}
+		if (GET32(blk + off) == 0 || namelen == 0)
+			continue;
+		memcpy(name, blk + off + 8, namelen);
+		name[namelen] = '\0';
+		if (IS_DOT_OR_DOTDOT(name) || memchr(name, '\0', namelen)
+		    != NULL || strchr(name, '/') != NULL)
+			continue;
+
+		fs->dents = grow(fs->dents, &fs->dents_size, fs->ndents,
+		    sizeof(*fs->dents));
+		e = &fs->dents[fs->ndents++];
+		e->dir = (uint32_t) dir;
+		e->ino = GET32(blk + off);
+		e->pos = (uint64_t) lblk << 32 | off;
+		e->name = arena_strdup(&fs->arena, name);
+	}
+}
+
+
+/*
+ * Output the content of directory "dir" (and of its sub-directories),
+ * "d" is its node (the reference is dropped).
+ */
+static int
+ext4_tree(struct ext4_fs *fs, struct dnode *d, const size_t dir)
+{
+	struct ext4_stack {
+		struct dnode	*d;
+		size_t		 dir;
+	}			*stack = NULL;
+	const struct pnode	*spn = NULL;
+	struct ext4_inode	*ino = NULL;
+	struct ext4_dent	*e = NULL;
+	FIST_SSTAT		 st;
+	size_t			 n = 0, size = 0, i, sdir;
+	int			 sproject, r = 0;
+
+	fs->dirs[dir].seen = 1;
+	stack = grow(stack, &size, n, sizeof(*stack));
+	stack[n].d = d;
+	stack[n++].dir = dir;
+
+	while (n > 0) {
+		d = stack[--n].d;
+		sdir = stack[n].dir;
+		for (i = 0; i < fs->dirs[sdir].count; i++) {
+			e = &fs->dents[fs->dirs[sdir].first + i];
+			if ((ino = ext4_inode_find(fs, e->ino)) == NULL) {
+				warning(-1, "'%s': entry '%s' refers to a free "
+				    "inode (%" PRIu32 ")", fs->image, e->name,
+				    e->ino);
+				r = 1;
+				continue;
+			}
+			ext4_stat(ino, &st);
+
+			spn = NULL;
+			sproject = d->project;
+			if (ino->dir != 0 && d->pn != NULL
+			    && (spn = pnode_child(d->pn, e->name, 0)) != NULL
+			    && spn->project != -1)
+				sproject = spn->project;
+
+			output(d, e->name, names_only ? NULL : &st, ino->lname,
+			    sproject);
+
+			if (ino->dir == 0 || fs->dirs[ino->dir - 1].seen)
+				continue;
+			fs->dirs[ino->dir - 1].seen = 1;
+			stack = grow(stack, &size, n, sizeof(*stack));
+			stack[n].d = dnode_new(d, e->name, spn, sproject);
+			stack[n++].dir = ino->dir - 1;
+		}
+		dnode_unref(d);
+	}
+	free(stack);
+
+	return (r);
+}
+
+
+static struct ext4_inode *
+ext4_inode_find(const struct ext4_fs *fs, const uint32_t number)
+{
+	size_t	lo = 0, hi = fs->ninodes, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fs->inodes[mid].ino == number)
+			return (&fs->inodes[mid]);
+		if (fs->inodes[mid].ino < number)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (NULL);
+}
+
+
+static void
+ext4_stat(const struct ext4_inode *ino, FIST_SSTAT *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino->ino;
+	st->st_mode = (mode_t) ino->mode;
+	st->st_nlink = ino->nlink;
+	st->st_uid = ino->uid;
+	st->st_gid = ino->gid;
+	st->st_size = (off_t) ino->size;
+	st->st_blocks = (blkcnt_t) ino->blocks;
+	st->st_atime = (time_t) ino->atime;
+	st->st_mtime = (time_t) ino->mtime;
+	st->st_ctime = (time_t) ino->ctime;
+}
+
+
+static int
+ext4_blk_cmp(const void *a, const void *b)
+{
+	const struct ext4_blk	*ba = a, *bb = b;
+
+	return (ba->pblk < bb->pblk ? -1 : (ba->pblk > bb->pblk));
+}
+
+
+static int
+ext4_dent_cmp(const void *a, const void *b)
+{
+	const struct ext4_dent	*ea = a, *eb = b;
+
+	if (ea->dir != eb->dir)
+		return (ea->dir < eb->dir ? -1 : 1);
+	return (ea->pos < eb->pos ? -1 : (ea->pos > eb->pos));
+}
+
+
+/*
+ * Hand an object (in directory "dir", NULL for the root) to the output
+ * thread.
+ * The metadata is gathered once and shared by all the outputs.
+ */
+static void
+output(struct dnode *dir, const char *name, const FIST_SSTAT *st,
+    const char *lname, const int project)
+{
+	struct qrec	*q = NULL;
+	size_t		 namelen, lnamelen;
+
+	namelen = strlen(name);
+	lnamelen = lname != NULL ? strlen(lname) : 0;
+
+	q = queue_reserve(sizeof(*q) + namelen + lnamelen + 2);
+	q->type = QREC_OBJ;
+	q->project = project;
+	if ((q->dir = dir) != NULL)
+		atomic_fetch_add(&dir->refs, 1);
+	if ((q->has_st = (st != NULL)))
+		q->st = *st;
+	q->namelen = namelen;
+	memcpy((char *) (q + 1), name, namelen + 1);
+	q->lnamelen = lname != NULL ? lnamelen : (size_t) -1;
+	if (lname != NULL)
+		memcpy((char *) (q + 1) + namelen + 1, lname, lnamelen + 1);
+
+	/* Publish the record */
+	atomic_store_explicit(&queue.head, atomic_load_explicit(&queue.head,
+	    memory_order_relaxed) + q->len, memory_order_release);
+}
+
+
+/*
+ * Room for a record of "len" bytes at the head of the queue (waiting for
+ * the output thread if needed), the record is published by the caller
+ * (by moving the head by "q->len").
+ */
+static struct qrec *
+queue_reserve(const size_t len)
+{
+	struct qrec	*q = NULL;
+	size_t		 need = QREC_ALIGN(len), head, off, room;
+	uint64_t	 t;
+	unsigned	 spins = 0;
+	int		 waited = 0;
+
+	if (need > queue.size / 2)
+		error(1, -1, "Object name too long for the output queue");
+
+	head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+	off = head & (queue.size - 1);
+	room = queue.size - off;
+	t = TRACE_NOW();
+
+	/* Records do not wrap around, skip the end of the ring */
+	if (room < need) {
+		while (head + room - atomic_load_explicit(&queue.tail,
+		    memory_order_acquire) > queue.size) {
+			queue_wait(&spins);
+			waited = 1;
+		}
+		q = (struct qrec *) (queue.ring + off);
+		q->len = room;
+		q->type = QREC_SKIP;
+		head += room;
+		atomic_store_explicit(&queue.head, head, memory_order_release);
+		off = 0;
+	}
+
+	while (head + need - atomic_load_explicit(&queue.tail,
+	    memory_order_acquire) > queue.size) {
+		queue_wait(&spins);
+		waited = 1;
+	}
+	queue.full_waits += waited;
+	if (waited)
+		trace_span(TRACE_QFULL, 0, t, 0, NULL, NULL);
+
+	q = (struct qrec *) (queue.ring + off);
+	q->len = need;
+
+	return (q);
+}
+
+
+/*
+ * Wait for the other side of the queue: spin for a while, then sleep.
+ */
+static void
+queue_wait(unsigned *spins)
+{
+	struct timespec	ts = { 0, 100000 };
+
+	if (++*spins < 64)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+}
+
+
+/*
+ * Consumer of the queue: hand the objects to all the outputs.
+ */
+static void *
+output_thread(void *arg)
+{
+	struct arena		 arena;
+	struct arena_mark	 start;
+	struct fist_obj		 o;
+	struct sink		*s = NULL;
+	struct qrec		*q = NULL;
+	/* Volatile for longjmp() (error() when embedded) */
+	struct dnode		*volatile dir = NULL;
+	const char		*volatile parent = NULL;
+	size_t			 tail, nrecs = 0;
+	volatile uint64_t	 t = TRACE_NOW();
+	unsigned		 spins;
+#ifdef FIST_EMBEDDED
+	jmp_buf			 jb;
+#endif /* FIST_EMBEDDED */
+
+	(void) arg;
+	pin_thread(1);
+	memset(&arena, 0, sizeof(arena));
+	start = arena_mark(&arena);
+
+#ifdef FIST_EMBEDDED
+	/* On error, the rest of the queue is dropped (the walker fails) */
+	error_jmp = &jb;
+	if (setjmp(jb) != 0) {
+		output_drop();
+		dnode_unref(dir);
+		arena_free(&arena);
+		return (NULL);
+	}
+#endif /* FIST_EMBEDDED */
+
+	for (;;) {
+		tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+		spins = 0;
+		if (atomic_load_explicit(&queue.head, memory_order_acquire)
+		    == tail) {
+			queue.empty_waits++;
+			if (nrecs > 0) {
+				trace_span(TRACE_OUTPUT, 1, t, nrecs, NULL,
+				    NULL);
+				PROBE1(output_drain, nrecs);
+			}
+			while (atomic_load_explicit(&queue.head,
+			    memory_order_acquire) == tail)
+				queue_wait(&spins);
+			t = TRACE_NOW();
+			nrecs = 0;
+		}
+		q = (struct qrec *) (queue.ring + (tail & (queue.size - 1)));
+		nrecs++;
+
+		if (q->type == QREC_END)
+			break;
+		if (q->type == QREC_OBJ) {
+			/*
+			 * The records of a directory are not consecutive
+			 * (dir_lookup() recurses in the middle of a batch):
+			 * its path is only built again when the directory
+			 * changes.
+			 */
+			if (q->dir != dir || dir == NULL) {
+				dnode_unref(dir);
+				dir = q->dir;
+				arena_release(&arena, &start);
+				parent = dir != NULL ?
+				    dnode_path(dir, &arena) : NULL;
+			} else
+				dnode_unref(q->dir);
+
+			o.name = (char *) (q + 1);
+			o.parent = parent;
+			o.st = q->has_st ? &q->st : NULL;
+			o.lname = q->lnamelen != (size_t) -1 ?
+			    (char *) (q + 1) + q->namelen + 1 : NULL;
+			o.project = q->project;
+
+			for (s = sinks; s != NULL; s = s->next)
+				if (filter_match(&s->filter, &o)) {
+					if (s->index != NULL)
+						index_add(s, &o);
+					s->type->emit(s, &o);
+				}
+		}
+
+		atomic_store_explicit(&queue.tail, tail + q->len,
+		    memory_order_release);
+	}
+
+	trace_span(TRACE_OUTPUT, 1, t, nrecs - 1, NULL, NULL);
+	PROBE1(output_drain, nrecs - 1);
+	dnode_unref(dir);
+	arena_free(&arena);
+
+	return (NULL);
+}
+
+
+#ifdef FIST_EMBEDDED
+/*
+ * Drop the records of the queue up to its end, from the one which failed
+ * (its directory reference is already taken).
+ */
+static void
+output_drop(void)
+{
+	struct qrec	*q = NULL;
+	size_t		 tail;
+	unsigned	 spins;
+	int		 skip = 1;
+
+	for (;;) {
+		tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+		spins = 0;
+		while (atomic_load_explicit(&queue.head, memory_order_acquire)
+		    == tail)
+			queue_wait(&spins);
+		q = (struct qrec *) (queue.ring + (tail & (queue.size - 1)));
+		if (q->type == QREC_END)
+			break;
+		if (q->type == QREC_OBJ && !skip)
+			dnode_unref(q->dir);
+		skip = 0;
+		atomic_store_explicit(&queue.tail, tail + q->len,
+		    memory_order_release);
+	}
+}
+#endif /* FIST_EMBEDDED */
+
+
+static void
+close_sinks(void)
+{
+	struct sink	*s = NULL;
+	uint64_t	 t;
+
+	for (s = sinks; s != NULL; s = s->next) {
+		t = TRACE_NOW();
+		PROBE2(flush_entry, s->type->name, s->path);
+		if (s->index != NULL)
+			index_close(s);
+		s->type->close(s);
+		trace_span(TRACE_FLUSH, 0, t, 0, s->path, NULL);
+		PROBE2(flush_return, s->type->name, s->path);
+	}
+}
+
+
+static void
+sink_stream_open(struct sink *s)
+{
+	if (strcmp(s->path, "-") == 0)
+		s->fp = stdout;
+	else if ((s->fp = fopen(s->path, "w")) == NULL)
+		error(1, errno, "Unable to open output file '%s'", s->path);
+
+	if (s->bufsize > 0) {
+		s->bufsize = budget_fit(s->bufsize, BUDGET_MINBUF,
+		    BUDGET_BUFFERS);
+		if ((s->buf = malloc(s->bufsize)) == NULL)
+			error(1, errno, "Unable to allocate output buffer");
+		setvbuf(s->fp, s->buf, _IOFBF, s->bufsize);
+	}
+}
+
+
+static void
+bin_open(struct sink *s)
+{
+	sink_stream_open(s);
+	fwrite(FIST_BIN_MAGIC, FIST_BIN_MAGICLEN, 1, s->fp);
+}
+
+
+static void
+sink_stream_close(struct sink *s)
+{
+	if (s->fp == stdout) {
+		if (fflush(s->fp) == EOF)
+			error(1, errno, "Error while writing to stdout");
+	} else if (fclose(s->fp) == EOF)
+		error(1, errno, "Error while writing to '%s'", s->path);
+	if (s->buf != NULL)
+		budget_give(s->bufsize);
+	free(s->buf);
+}
+
+
+static void
+text_emit(struct sink *s, const struct fist_obj *o)
+{
+	if (o->st == NULL) {
+		print_name(s->fp, o->name, o->parent);
+		fputc('\n', s->fp);
+	} else
+		print_metadata(s->fp, o);
+}
+
+
+static void
+bin_emit(struct sink *s, const struct fist_obj *o)
+{
+	unsigned char		 hdr[FIST_BIN_HDRLEN];
+	const FIST_SSTAT	*st = o->st;
+	size_t			 plen, nlen, llen;
+
+	plen = o->parent != NULL ? strlen(o->parent) + 1 : 0;
+	nlen = strlen(o->name);
+	llen = o->lname != NULL ? strlen(o->lname) : 0;
+
+	PUT64(hdr, (uint64_t) ((st->st_blocks + 1) >> 1));
+	PUT64(hdr + 8, (uint64_t) st->st_size);
+	PUT64(hdr + 16, (int64_t) st->st_mtime);
+	PUT64(hdr + 24, (int64_t) st->st_atime);
+	PUT64(hdr + 32, (int64_t) st->st_ctime);
+	PUT32(hdr + 40, (uint32_t) st->st_mode);
+	PUT32(hdr + 44, (uint32_t) st->st_nlink);
+	PUT32(hdr + 48, (uint32_t) st->st_uid);
+	PUT32(hdr + 52, (uint32_t) st->st_gid);
+	PUT32(hdr + 56, (uint32_t) (plen + nlen));
+	PUT32(hdr + 60, (uint32_t) llen);
+
+	fwrite(hdr, sizeof(hdr), 1, s->fp);
+	if (o->parent != NULL) {
+		fwrite(o->parent, plen - 1, 1, s->fp);
+		fputc('/', s->fp);
+	}
+	fwrite(o->name, nlen, 1, s->fp);
+	if (llen > 0)
+		fwrite(o->lname, llen, 1, s->fp);
+}
+
+
+/*
+ * Per UID ("users") or per GID ("groups") aggregated counters, written
+ * as JSON when the traversal is complete.
+ */
+static void
+owners_open(struct sink *s)
+{
+	struct owners	*ow = NULL;
+
+	if ((ow = calloc(1, sizeof(*ow))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	ow->bygid = (strcmp(s->type->name, "groups") == 0);
+	ow->size = 1024;
+	if ((ow->tab = calloc(ow->size, sizeof(*ow->tab))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	budget_take(ow->size * sizeof(*ow->tab), 1);
+	s->data = ow;
+
+	sink_stream_open(s);
+}
+
+
+static struct owner *
+owner_lookup(struct owners *ow, const uint32_t id)
+{
+	struct owner	*old = NULL;
+	size_t		 i, oldsize;
+
+	/* Keep the table at most half full */
+	if (ow->count * 2 >= ow->size) {
+		old = ow->tab;
+		oldsize = ow->size;
+		ow->size *= 2;
+		if ((ow->tab = calloc(ow->size, sizeof(*ow->tab))) == NULL)
+			error(1, errno, "Unable to allocate output");
+		budget_take(oldsize * sizeof(*ow->tab), 1);
+		ow->count = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].used)
+				*owner_lookup(ow, old[i].id) = old[i];
+		free(old);
+	}
+
+	for (i = (id * 2654435761U) & (ow->size - 1); ow->tab[i].used;
+	    i = (i + 1) & (ow->size - 1))
+		if (ow->tab[i].id == id)
+			return (&ow->tab[i]);
+
+	ow->tab[i].used = 1;
+	ow->tab[i].id = id;
+	ow->count++;
+
+	return (&ow->tab[i]);
+}
+
+
+static void
+owners_emit(struct sink *s, const struct fist_obj *o)
+{
+	struct owners	*ow = s->data;
+	struct owner	*e = NULL;
+
+	e = owner_lookup(ow, ow->bygid ? (uint32_t) o->st->st_gid
+	    : (uint32_t) o->st->st_uid);
+	counters_add(&e->c, o->st);
+	counters_add(&ow->totals, o->st);
+}
+
+
+static void
+owners_close(struct sink *s)
+{
+	struct owners	*ow = s->data;
+	size_t		 i, n;
+
+	/* Largest first */
+	for (i = n = 0; i < ow->size; i++)
+		if (ow->tab[i].used)
+			ow->tab[n++] = ow->tab[i];
+	qsort(ow->tab, n, sizeof(*ow->tab), owner_cmp);
+
+	fprintf(s->fp, "{\n    \"%s\": [\n", ow->bygid ? "groups" : "users");
+	for (i = 0; i < n; i++) {
+		fprintf(s->fp, "        {\n            \"%s\": %" PRIu32 ",\n",
+		    ow->bygid ? "gid" : "uid", ow->tab[i].id);
+		fprintf(s->fp, "            \"name\": ");
+		print_json_string(s->fp, idcache_lookup(ow->bygid ? 'g' : 'u',
+		    ow->tab[i].id)->name);
+		fprintf(s->fp, ",\n");
+		print_counters_json(s->fp, &ow->tab[i].c, "            ");
+		fprintf(s->fp, "        }%s\n", i + 1 < n ? "," : "");
+	}
+	fprintf(s->fp, "    ],\n    \"totals\": {\n");
+	fprintf(s->fp, "        \"n%s\": %zu,\n",
+	    ow->bygid ? "groups" : "users", n);
+	print_counters_json(s->fp, &ow->totals, "        ");
+	fprintf(s->fp, "    }\n}\n");
+	sink_stream_close(s);
+
+	free(ow->tab);
+	free(ow);
+}
+
+
+static int
+owner_cmp(const void *a, const void *b)
+{
+	const struct owner	*oa = a, *ob = b;
+
+	if (oa->c.bytes != ob->c.bytes)
+		return (oa->c.bytes < ob->c.bytes ? 1 : -1);
+	return (oa->id < ob->id ? -1 : (oa->id > ob->id));
+}
+
+
+/*
+ * Per project aggregated counters (objects outside of any project are
+ * counted separately), written as JSON when the traversal is complete.
+ */
+static void
+projects_open(struct sink *s)
+{
+	if (nprojects == 0)
+		error(1, -1, "\"projects\" output requires a projects file (-p)");
+
+	/* The last one is for the objects outside of any project */
+	if ((s->data = calloc(nprojects + 1, sizeof(struct counters))) == NULL)
+		error(1, errno, "Unable to allocate output");
+
+	sink_stream_open(s);
+}
+
+
+static void
+projects_emit(struct sink *s, const struct fist_obj *o)
+{
+	struct counters	*c = s->data;
+
+	counters_add(&c[o->project != -1 ? (size_t) o->project : nprojects],
+	    o->st);
+}
+
+
+static void
+projects_close(struct sink *s)
+{
+	struct counters	*c = s->data;
+	size_t		 i;
+
+	fprintf(s->fp, "{\n    \"projects\": [\n");
+	for (i = 0; i < nprojects; i++) {
+		fprintf(s->fp, "        {\n            \"name\": \"%s\",\n",
+		    pnames[i]);
+		print_counters_json(s->fp, &c[i], "            ");
+		fprintf(s->fp, "        }%s\n", i + 1 < nprojects ? "," : "");
+	}
+	fprintf(s->fp, "    ],\n    \"unattributed\": {\n");
+	print_counters_json(s->fp, &c[nprojects], "        ");
+	fprintf(s->fp, "    }\n}\n");
+	sink_stream_close(s);
+
+	free(c);
+}
+
+
+/*
+ * History: the per UID, GID and project totals of each traversal are
+ * appended as a "snapshot" to a (small) file, for trend reports (--trend)
+ * without reprocessing old dumps.
+ * Projects records are only written with a projects file (-p).
+ */
+static void
+history_open(struct sink *s)
+{
+	struct history	*h = NULL;
+	char		 magic[sizeof(FIST_HIST_MAGIC) - 1];
+	ssize_t		 n;
+
+	if (strcmp(s->path, "-") == 0)
+		error(1, -1, "\"history\" output requires a file");
+	if ((h = calloc(1, sizeof(*h))) == NULL
+	    || (h->projects = calloc(nprojects + 1, sizeof(*h->projects)))
+	    == NULL)
+		error(1, errno, "Unable to allocate output");
+	h->time = time(NULL);
+	h->users.size = h->groups.size = 1024;
+	h->groups.bygid = 1;
+	if ((h->users.tab = calloc(h->users.size, sizeof(*h->users.tab)))
+	    == NULL || (h->groups.tab = calloc(h->groups.size,
+	    sizeof(*h->groups.tab))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	s->data = h;
+
+	/* Appended to (reads are from the beginning, for the magic) */
+	if ((h->fd = open(s->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0666)) == -1)
+		error(1, errno, "Unable to open output file '%s'", s->path);
+	if ((n = read(h->fd, magic, sizeof(magic))) == -1)
+		error(1, errno, "Unable to read '%s'", s->path);
+	if (n == 0)
+		h->empty = 1;
+	else if (n != sizeof(magic)
+	    || memcmp(magic, FIST_HIST_MAGIC, sizeof(magic)) != 0)
+		error(1, -1, "'%s' is not a history file", s->path);
+}
+
+
+static void
+history_emit(struct sink *s, const struct fist_obj *o)
+{
+	struct history	*h = s->data;
+
+	counters_add(&owner_lookup(&h->users, (uint32_t) o->st->st_uid)->c,
+	    o->st);
+	counters_add(&owner_lookup(&h->groups, (uint32_t) o->st->st_gid)->c,
+	    o->st);
+	if (o->project != -1)
+		counters_add(&h->projects[o->project], o->st);
+}
+
+
+static void
+history_close(struct sink *s)
+{
+	struct history		*h = s->data;
+	const struct owners	*ow = NULL;
+	unsigned char		*buf = NULL, *snap = NULL, *p = NULL;
+	size_t			 i, len, nrecs, mlen;
+	ssize_t			 n;
+
+	mlen = h->empty ? sizeof(FIST_HIST_MAGIC) - 1 : 0;
+	len = FIST_HIST_SNAPLEN;
+	nrecs = h->users.count + h->groups.count;
+	for (i = 0; i < nprojects; i++)
+		if (h->projects[i].nfiles + h->projects[i].ndirs
+		    + h->projects[i].nsymlinks + h->projects[i].nothers > 0) {
+			len += strlen(pnames[i]);
+			nrecs++;
+		}
+	len += nrecs * FIST_HIST_RECLEN + FIST_HIST_TRAILERLEN;
+
+	/* The whole snapshot (and the magic of a new file) at once */
+	if ((buf = malloc(mlen + len)) == NULL)
+		error(1, errno, "Unable to allocate output");
+	memcpy(buf, FIST_HIST_MAGIC, mlen);
+	snap = buf + mlen;
+	memcpy(snap, FIST_HIST_SNAPMAGIC, 4);
+	PUT64(snap + 4, (int64_t) h->time);
+	PUT32(snap + 12, (uint32_t) nrecs);
+	PUT32(snap + 16, (uint32_t) (len - FIST_HIST_SNAPLEN
+	    - FIST_HIST_TRAILERLEN));
+	p = snap + FIST_HIST_SNAPLEN;
+	for (ow = &h->users; ow != NULL; ow = ow == &h->users ? &h->groups
+	    : NULL)
+		for (i = 0; i < ow->size; i++)
+			if (ow->tab[i].used) {
+				history_record(p, ow->bygid ? 'g' : 'u',
+				    ow->tab[i].id, &ow->tab[i].c);
+				p += FIST_HIST_RECLEN;
+			}
+	for (i = 0; i < nprojects; i++)
+		if (h->projects[i].nfiles + h->projects[i].ndirs
+		    + h->projects[i].nsymlinks + h->projects[i].nothers > 0) {
+			history_record(p, 'p', (uint32_t) strlen(pnames[i]),
+			    &h->projects[i]);
+			memcpy(p + FIST_HIST_RECLEN, pnames[i],
+			    strlen(pnames[i]));
+			p += FIST_HIST_RECLEN + strlen(pnames[i]);
+		}
+	PUT32(p, (uint32_t) (p - snap - FIST_HIST_SNAPLEN));
+	PUT32(p + 4, history_sum(snap, snap + FIST_HIST_SNAPLEN,
+	    (size_t) (p - snap - FIST_HIST_SNAPLEN)));
+
+	/* A short write leaves a torn snapshot, skipped by the readers */
+	if ((n = write(h->fd, buf, mlen + len)) == -1 || close(h->fd) == -1)
+		error(1, errno, "Error while writing to '%s'", s->path);
+	if ((size_t) n != mlen + len)
+		error(1, -1, "Short write to '%s' (%zd of %zu bytes)", s->path,
+		    n, mlen + len);
+
+	free(buf);
+	free(h->users.tab);
+	free(h->groups.tab);
+	free(h->projects);
+	free(h);
+}
+
+
+static void
+history_record(unsigned char *p, const int kind, const uint32_t id,
+	const struct counters *c)
+{
+	PUT32(p, (uint32_t) kind);
+	PUT32(p + 4, id);
+	PUT64(p + 8, c->nfiles);
+	PUT64(p + 16, c->nfiles + c->ndirs + c->nsymlinks + c->nothers);
+	PUT64(p + 24, c->bytes);
+	PUT64(p + 32, c->kib);
+}
+
+
+/*
+ * --trend: growth of the totals between the first and the last snapshots
+ * of a history file in a time range ("from=N" and "to=N" days ago), as
+ * JSON, with the totals of each snapshot in the range ("series").
+ * The snapshots outside of the range are skipped without being read.
+ */
+static int
+history_trend(const char *arg)
+{
+	struct hrec	*first = NULL, *last = NULL, *cur = NULL, *f, *l, *fe, *le;
+	unsigned char	 hdr[FIST_HIST_SNAPLEN], *recs = NULL;
+	char		 magic[sizeof(FIST_HIST_MAGIC) - 1];
+	size_t		 size = 0;
+	char		*spec = NULL, *path = NULL, *opt = NULL, *val = NULL;
+	char		*next = NULL;
+	const char	*sep = "";
+	FILE		*fp = NULL;
+	time_t		 from = 0, to = 0, t, t0 = 0, t1 = 0, now = time(NULL);
+	size_t		 nfirst = 0, nlast = 0, ncur, len, nsnaps = 0, i;
+	uint64_t	 files, objects, bytes, kib;
+	double		 days;
+	int		 cmp;
+
+	if ((spec = strdup(arg)) == NULL)
+		error(1, errno, "Unable to allocate trend");
+	path = spec;
+	if (strncmp(spec, "from=", 5) == 0 || strncmp(spec, "to=", 3) == 0) {
+		if ((path = strchr(spec, ':')) == NULL)
+			error(1, -1, "Invalid trend '%s' (no file)", arg);
+		*path++ = '\0';
+		for (next = spec; (opt = next) != NULL; ) {
+			if ((next = strchr(opt, ',')) != NULL)
+				*next++ = '\0';
+			if ((val = strchr(opt, '=')) == NULL)
+				error(1, -1, "Invalid trend option '%s'", opt);
+			*val++ = '\0';
+			if (strcmp(opt, "from") == 0)
+				from = now - (time_t) parse_number(opt, val)
+				    * 86400;
+			else if (strcmp(opt, "to") == 0)
+				to = now - (time_t) parse_number(opt, val)
+				    * 86400;
+			else
+				error(1, -1, "Unknown trend option '%s'", opt);
+		}
+	}
+
+	if ((fp = fopen(path, "r")) == NULL)
+		error(1, errno, "Unable to open '%s'", path);
+	if (fread(magic, sizeof(magic), 1, fp) != 1
+	    || memcmp(magic, FIST_HIST_MAGIC, sizeof(magic)) != 0)
+		error(1, -1, "'%s' is not a history file", path);
+
+	printf("{\n    \"series\": [");
+	while (history_read(fp, path, from, to, hdr, &recs, &size) == 1) {
+		t = (time_t) GET64(hdr + 4);
+		ncur = GET32(hdr + 12);
+		len = GET32(hdr + 16);
+		cur = history_parse(recs, len, ncur, &files, &objects, &bytes,
+		    &kib);
+		printf("%s\n        { \"time\": %lld, \"nfiles\": %" PRIu64
+		    ", \"nobjects\": %" PRIu64 ", \"bytes\": %" PRIu64
+		    ", \"kib\": %" PRIu64 " }", sep, (long long) t, files,
+		    objects, bytes, kib);
+		sep = ",";
+
+		/* Keep the first and the last snapshots */
+		if (nsnaps++ == 0) {
+			first = cur;
+			nfirst = ncur;
+			t0 = t;
+		} else {
+			if (last != NULL)
+				history_free(last, nlast);
+			last = cur;
+			nlast = ncur;
+		}
+		t1 = t;
+	}
+	fclose(fp);
+	free(recs);
+	if (last == NULL) {
+		last = first;
+		nlast = nfirst;
+	}
+
+	/* Both are sorted, so they can be merged */
+	printf("\n    ],\n    \"from\": %lld,\n    \"to\": %lld,\n"
+	    "    \"snapshots\": %zu,\n    \"trends\": [", (long long) t0,
+	    (long long) t1, nsnaps);
+	days = (double) (t1 - t0) / 86400.0;
+	sep = "";
+	f = first;
+	fe = first + nfirst;
+	l = last;
+	le = last + nlast;
+	while (f < fe || l < le) {
+		if (f == fe)
+			cmp = 1;
+		else if (l == le)
+			cmp = -1;
+		else
+			cmp = hrec_cmp(f, l);
+		printf("%s\n        {\n", sep);
+		sep = ",";
+		cur = cmp <= 0 ? f : l;
+		if (cur->kind == 'p') {
+			printf("            \"project\": ");
+			print_json_string(stdout, cur->name);
+		} else {
+			printf("            \"%s\": %" PRIu32 ",\n"
+			    "            \"name\": ", cur->kind == 'u' ? "uid"
+			    : "gid", cur->id);
+			print_json_string(stdout,
+			    idcache_lookup(cur->kind, cur->id)->name);
+		}
+		printf(",\n");
+		for (i = 0; i < 4; i++)
+			printf("            \"%s\": [%" PRIu64 ", %" PRIu64 "],\n",
+			    hrec_names[i], cmp <= 0 ? f->v[i] : 0,
+			    cmp >= 0 ? l->v[i] : 0);
+		printf("            \"bytesperday\": %.0f\n        }",
+		    days > 0 ? ((double) (cmp >= 0 ? l->v[2] : 0)
+		    - (double) (cmp <= 0 ? f->v[2] : 0)) / days : 0.0);
+		if (cmp <= 0)
+			f++;
+		if (cmp >= 0)
+			l++;
+	}
+	printf("\n    ]\n}\n");
+	if (fflush(stdout) == EOF)
+		error(1, errno, "Error while writing to stdout");
+
+	if (last != first)
+		history_free(last, nlast);
+	history_free(first, nfirst);
+	free(spec);
+
+	return (0);
+}
+
+
+
+/*
+ * Next snapshot of history "fp" in the time range ("from", "to", 0: no
+ * limit): its header in "hdr", its records in "*recs" (of "*size" bytes
+ * allocated).  The snapshots out of the range are skipped (without being
+ * read), the damaged ones (torn by a crash or a full filesystem) too, up
+ * to the next snapshot magic.
+ * Returns 1 for a snapshot, 0 at the end of the file.
+ */
+static int
+history_read(FILE *fp, const char *path, const time_t from, const time_t to,
+    unsigned char *hdr, unsigned char **recs, size_t *size)
+{
+	unsigned char	 trailer[FIST_HIST_TRAILERLEN];
+	FIST_SSTAT	 st;
+	off_t		 start, damaged = -1;
+	size_t		 len, match;
+	time_t		 t;
+	int		 c;
+
+	if (FIST_FSTAT(fileno(fp), &st) == -1)
+		error(1, errno, "Unable to stat '%s'", path);
+
+	for (;;) {
+		if ((start = ftello(fp)) == -1)
+			error(1, errno, "Unable to read '%s'", path);
+		if (fread(hdr, FIST_HIST_SNAPLEN, 1, fp) != 1)
+			break;
+		t = (time_t) GET64(hdr + 4);
+		len = GET32(hdr + 16);
+		if (memcmp(hdr, FIST_HIST_SNAPMAGIC, 4) == 0
+		    && (off_t) len <= st.st_size - start - FIST_HIST_SNAPLEN
+		    - FIST_HIST_TRAILERLEN) {
+			if (t < from || (to != 0 && t > to)) {
+				/* Only the length is checked */
+				if (fseeko(fp, (off_t) len, SEEK_CUR) == -1
+				    || fread(trailer, sizeof(trailer), 1, fp)
+				    != 1)
+					error(1, errno, "Unable to read '%s'",
+					    path);
+				if (GET32(trailer) == len) {
+					if (damaged != -1)
+						warning(-1, "'%s': damaged "
+						    "snapshot at offset %lld "
+						    "skipped", path,
+						    (long long) damaged);
+					damaged = -1;
+					continue;
+				}
+			} else {
+				if (len + FIST_HIST_TRAILERLEN > *size) {
+					*size = len + FIST_HIST_TRAILERLEN;
+					if ((*recs = realloc(*recs, *size))
+					    == NULL)
+						error(1, errno, "Unable to "
+						    "allocate trend");
+				}
+				if (fread(*recs, len + FIST_HIST_TRAILERLEN, 1,
+				    fp) != 1)
+					error(1, errno, "Unable to read '%s'",
+					    path);
+				if (GET32(*recs + len) == len
+				    && GET32(*recs + len + 4)
+				    == history_sum(hdr, *recs, len)) {
+					if (damaged != -1)
+						warning(-1, "'%s': damaged "
+						    "snapshot at offset %lld "
+						    "skipped", path,
+						    (long long) damaged);
+					return (1);
+				}
+			}
+		}
+
+		/* Damaged, resynchronize on the next snapshot magic */
+		if (damaged == -1)
+			damaged = start;
+		if (fseeko(fp, start + 1, SEEK_SET) == -1)
+			error(1, errno, "Unable to read '%s'", path);
+		for (match = 0; match < 4 && (c = getc(fp)) != EOF; )
+			if (c == FIST_HIST_SNAPMAGIC[match])
+				match++;
+			else
+				match = c == FIST_HIST_SNAPMAGIC[0];
+		if (match < 4)
+			break;
+		if (fseeko(fp, -4, SEEK_CUR) == -1)
+			error(1, errno, "Unable to read '%s'", path);
+	}
+
+	if (damaged != -1 || start != st.st_size)
+		warning(-1, "'%s': damaged snapshot at offset %lld skipped",
+		    path, (long long) (damaged != -1 ? damaged : start));
+
+	return (0);
+}
+
+
+/*
+ * Checksum (FNV-1a) of a snapshot header (without its magic) and records.
+ */
+static uint32_t
+history_sum(const unsigned char *hdr, const unsigned char *recs,
+    const size_t len)
+{
+	uint32_t	 h = 2166136261U;
+	size_t		 i;
+
+	for (i = 4; i < FIST_HIST_SNAPLEN; i++)
+		h = (h ^ hdr[i]) * 16777619U;
+	for (i = 0; i < len; i++)
+		h = (h ^ recs[i]) * 16777619U;
+
+	return (h);
+}
+
+/*
+ * Records of a snapshot, sorted, and their (per UID) totals.
+ */
+static struct hrec *
+history_parse(const unsigned char *p, const size_t len, const size_t n,
+	uint64_t *files, uint64_t *objects, uint64_t *bytes, uint64_t *kib)
+{
+	const unsigned char	*end = p + len;
+	struct hrec		*r = NULL;
+	size_t			 i, nlen;
+
+	if ((r = calloc(n + 1, sizeof(*r))) == NULL)
+		error(1, errno, "Unable to allocate trend");
+	*files = *objects = *bytes = *kib = 0;
+	for (i = 0; i < n; i++) {
+		if (end - p < FIST_HIST_RECLEN)
+			error(1, -1, "Invalid history snapshot");
+		r[i].kind = (int) GET32(p);
+		r[i].id = GET32(p + 4);
+		r[i].v[0] = GET64(p + 8);
+		r[i].v[1] = GET64(p + 16);
+		r[i].v[2] = GET64(p + 24);
+		r[i].v[3] = GET64(p + 32);
+		p += FIST_HIST_RECLEN;
+		if (r[i].kind == 'p') {
+			nlen = r[i].id;
+			if ((size_t) (end - p) < nlen)
+				error(1, -1, "Invalid history snapshot");
+			if ((r[i].name = strndup((const char *) p, nlen))
+			    == NULL)
+				error(1, errno, "Unable to allocate trend");
+			p += nlen;
+		} else if (r[i].kind == 'u') {
+			*files += r[i].v[0];
+			*objects += r[i].v[1];
+			*bytes += r[i].v[2];
+			*kib += r[i].v[3];
+		}
+	}
+	qsort(r, n, sizeof(*r), hrec_cmp);
+
+	return (r);
+}
+
+
+static void
+history_free(struct hrec *r, const size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		free(r[i].name);
+	free(r);
+}
+
+
+static int
+hrec_cmp(const void *a, const void *b)
+{
+	const struct hrec	*ra = a, *rb = b;
+
+	if (ra->kind != rb->kind)
+		return (rb->kind - ra->kind);	/* 'u', 'p', 'g' */
+	if (ra->kind == 'p')
+		return (strcmp(ra->name, rb->name));
+	return (ra->id < rb->id ? -1 : (ra->id > rb->id));
+}
+
+
+/*
+ * Owner index of a dump ("index=N" option of the text and bin outputs),
+ * written next to it ("dump.idx"): the dump is divided in blocks of N
+ * records, the offsets of the blocks are kept, and for each UID and GID
+ * the blocks with its objects, as runs of consecutive blocks (i.e. a run
+ * length compressed bitmap).
+ * "--lookup" then only reads the blocks of the requested owner.
+ */
+static void
+index_open(struct sink *s)
+{
+	if (strcmp(s->path, "-") == 0)
+		error(1, -1, "An indexed output requires a file");
+	if ((s->index = calloc(1, sizeof(*s->index))) == NULL)
+		error(1, errno, "Unable to allocate index");
+	s->index->block = s->index_block;
+}
+
+
+/*
+ * Account for an object about to be written to the dump of "s".
+ */
+static void
+index_add(struct sink *s, const struct fist_obj *o)
+{
+	struct index	*ix = s->index;
+	struct index_id	*e = NULL;
+	uint64_t	 block;
+	off_t		 off;
+	int		 i;
+
+	block = ix->nrecs++ / ix->block;
+	if (block == ix->noffsets) {
+		if ((off = ftello(s->fp)) == -1)
+			error(1, errno, "Unable to index '%s'", s->path);
+		ix->offsets = grow(ix->offsets, &ix->offsets_size,
+		    ix->noffsets, sizeof(*ix->offsets));
+		ix->offsets[ix->noffsets++] = (uint64_t) off;
+	}
+
+	for (i = 0; i < 2; i++) {
+		e = index_lookup(ix, i == 0 ? 'u' : 'g', i == 0 ?
+		    (uint32_t) o->st->st_uid : (uint32_t) o->st->st_gid);
+		e->nobjs++;
+		if (e->nruns > 0 && e->runs[2 * e->nruns - 2]
+		    + e->runs[2 * e->nruns - 1] >= block + 1)
+			continue;	/* already in the last run */
+		if (e->nruns > 0 && e->runs[2 * e->nruns - 2]
+		    + e->runs[2 * e->nruns - 1] == block) {
+			e->runs[2 * e->nruns - 1]++;
+			continue;
+		}
+		e->runs = grow(e->runs, &e->runs_size, 2 * e->nruns + 1,
+		    sizeof(*e->runs));
+		e->runs[2 * e->nruns] = block;
+		e->runs[2 * e->nruns + 1] = 1;
+		e->nruns++;
+	}
+}
+
+
+static struct index_id *
+index_lookup(struct index *ix, const int kind, const uint32_t id)
+{
+	struct index_id	*old = NULL;
+	size_t		 i, oldsize;
+
+	/* Keep the table at most half full */
+	if (ix->count * 2 >= ix->size) {
+		old = ix->tab;
+		oldsize = ix->size;
+		ix->size = oldsize == 0 ? 1024 : oldsize * 2;
+		if ((ix->tab = calloc(ix->size, sizeof(*ix->tab))) == NULL)
+			error(1, errno, "Unable to allocate index");
+		budget_take((ix->size - oldsize) * sizeof(*ix->tab), 1);
+		ix->count = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].kind != 0)
+				*index_lookup(ix, old[i].kind, old[i].id)
+				    = old[i];
+		free(old);
+	}
+
+	for (i = ((id ^ (uint32_t) kind) * 2654435761U) & (ix->size - 1);
+	    ix->tab[i].kind != 0; i = (i + 1) & (ix->size - 1))
+		if (ix->tab[i].id == id && ix->tab[i].kind == kind)
+			return (&ix->tab[i]);
+
+	ix->tab[i].kind = kind;
+	ix->tab[i].id = id;
+	ix->count++;
+
+	return (&ix->tab[i]);
+}
+
+
+/*
+ * Write "dump.idx" (before the dump is closed, its size is the end of
+ * the last block): a header (FIST_IDX_MAGIC, records per block, number of
+ * records and of blocks as 64 bits integers, number of IDs as a 32 bits
+ * integer), the blocks offsets (and the dump size) as 64 bits integers,
+ * the IDs table sorted by kind and ID (kind, ID as 32 bits integers then
+ * number of objects, offset and length of the runs as 64 bits integers)
+ * and the runs (distance from the end of the previous run and length, as
+ * LEB128 numbers).  All little-endian.
+ */
+static void
+index_close(struct sink *s)
+{
+	struct index	*ix = s->index;
+	unsigned char	 hdr[FIST_IDX_HDRLEN], ent[FIST_IDX_ENTLEN];
+	unsigned char	*runs = NULL, *p = NULL;
+	char		*path = NULL;
+	FILE		*fp = NULL;
+	size_t		 i, n, len = 0, size = 0;
+	uint64_t	 r, prev, off = 0;
+	off_t		 end;
+
+	if (fflush(s->fp) == EOF || (end = ftello(s->fp)) == -1)
+		error(1, errno, "Error while writing to '%s'", s->path);
+	if (asprintf(&path, "%s.idx", s->path) == -1)
+		error(1, errno, "Unable to allocate index");
+	if ((fp = fopen(path, "w")) == NULL)
+		error(1, errno, "Unable to open index '%s'", path);
+
+	for (i = n = 0; i < ix->size; i++)
+		if (ix->tab[i].kind != 0)
+			ix->tab[n++] = ix->tab[i];
+	qsort(ix->tab, n, sizeof(*ix->tab), index_id_cmp);
+
+	memcpy(hdr, FIST_IDX_MAGIC, 8);
+	PUT64(hdr + 8, ix->block);
+	PUT64(hdr + 16, ix->nrecs);
+	PUT64(hdr + 24, (uint64_t) ix->noffsets);
+	PUT32(hdr + 32, (uint32_t) n);
+	PUT32(hdr + 36, 0);
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1)
+		error(1, errno, "Error while writing to '%s'", path);
+	for (i = 0; i <= ix->noffsets; i++) {
+		PUT64(ent, i < ix->noffsets ? ix->offsets[i] : (uint64_t) end);
+		if (fwrite(ent, 8, 1, fp) != 1)
+			error(1, errno, "Error while writing to '%s'", path);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (r = 0, prev = 0; r < ix->tab[i].nruns; r++) {
+			runs = grow(runs, &size, len + 20, 1);
+			p = leb128_put(runs + len, ix->tab[i].runs[2 * r]
+			    - prev);
+			p = leb128_put(p, ix->tab[i].runs[2 * r + 1]);
+			len = (size_t) (p - runs);
+			prev = ix->tab[i].runs[2 * r]
+			    + ix->tab[i].runs[2 * r + 1];
+		}
+		PUT32(ent, (uint32_t) ix->tab[i].kind);
+		PUT32(ent + 4, ix->tab[i].id);
+		PUT64(ent + 8, ix->tab[i].nobjs);
+		PUT64(ent + 16, off);
+		PUT64(ent + 24, (uint64_t) len - off);
+		if (fwrite(ent, sizeof(ent), 1, fp) != 1)
+			error(1, errno, "Error while writing to '%s'", path);
+		off = len;
+		budget_give(ix->tab[i].runs_size * sizeof(*ix->tab[i].runs));
+		free(ix->tab[i].runs);
+	}
+	if ((len > 0 && fwrite(runs, len, 1, fp) != 1) || fclose(fp) == EOF)
+		error(1, errno, "Error while writing to '%s'", path);
+
+	budget_give(size + ix->size * sizeof(*ix->tab) + ix->offsets_size
+	    * sizeof(*ix->offsets));
+	free(runs);
+	free(path);
+	free(ix->tab);
+	free(ix->offsets);
+	free(ix);
+	s->index = NULL;
+}
+
+
+static int
+index_id_cmp(const void *a, const void *b)
+{
+	const struct index_id	*ia = a, *ib = b;
+
+	if (ia->kind != ib->kind)
+		return (ib->kind - ia->kind);	/* 'u' first */
+	return (ia->id < ib->id ? -1 : (ia->id > ib->id));
+}
+
+
+static unsigned char *
+leb128_put(unsigned char *p, uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = (unsigned char) (v | 0x80);
+	*p++ = (unsigned char) v;
+
+	return (p);
+}
+
+
+static int
+leb128_get(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	int	shift;
+
+	for (*v = 0, shift = 0; *p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t) (**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			return (0);
+	}
+	return (-1);
+}
+
+
+/*
+ * --lookup: print the records of a dump (text or binary) owned by a UID
+ * and/or GID ("uid=N,gid=N:dump"), only the blocks of the dump index with
+ * objects of these owners are read.
+ */
+static int
+index_lookup_dump(const char *arg)
+{
+	unsigned char	*idx = NULL, *blocks = NULL, *buf = NULL;
+	unsigned char	*p = NULL, *rec = NULL, *end = NULL;
+	char		*spec = NULL, *path = NULL, *opt = NULL, *val = NULL;
+	char		*next = NULL, *ipath = NULL;
+	char		 magic[FIST_BIN_MAGICLEN];
+	long		 want[2] = { -1, -1 };
+	uint64_t	 nblocks, nids, b, n, uid, gid, nread = 0, nrecs = 0;
+	uint64_t	 first, last, dumpsize;
+	size_t		 idxlen, buflen = 0, len;
+	int		 fd, bin, i;
+
+	if ((spec = strdup(arg)) == NULL)
+		error(1, errno, "Unable to allocate lookup");
+	if ((path = strchr(spec, ':')) == NULL || path[1] == '\0')
+		error(1, -1, "Invalid lookup '%s' (no dump)", arg);
+	*path++ = '\0';
+	for (next = spec; (opt = next) != NULL; ) {
+		if ((next = strchr(opt, ',')) != NULL)
+			*next++ = '\0';
+		if ((val = strchr(opt, '=')) == NULL)
+			error(1, -1, "Invalid lookup option '%s'", opt);
+		*val++ = '\0';
+		if (strcmp(opt, "uid") == 0)
+			want[0] = (long) parse_number(opt, val);
+		else if (strcmp(opt, "gid") == 0)
+			want[1] = (long) parse_number(opt, val);
+		else
+			error(1, -1, "Unknown lookup option '%s'", opt);
+	}
+	if (want[0] == -1 && want[1] == -1)
+		error(1, -1, "Lookup requires a UID or a GID");
+
+	if (asprintf(&ipath, "%s.idx", path) == -1)
+		error(1, errno, "Unable to allocate lookup");
+	idx = read_file(ipath, &idxlen);
+	if (idxlen < FIST_IDX_HDRLEN || memcmp(idx, FIST_IDX_MAGIC, 8) != 0)
+		error(1, -1, "'%s' is not a dump index", ipath);
+	nblocks = GET64(idx + 24);
+	nids = GET32(idx + 32);
+	if ((idxlen - FIST_IDX_HDRLEN) / 8 <= nblocks || (idxlen
+	    - FIST_IDX_HDRLEN - (nblocks + 1) * 8) / FIST_IDX_ENTLEN < nids)
+		error(1, -1, "'%s': invalid index", ipath);
+	dumpsize = GET64(idx + FIST_IDX_HDRLEN + nblocks * 8);
+
+	/* Blocks with objects of the requested UID and GID */
+	if ((blocks = calloc(nblocks + 1, 1)) == NULL)
+		error(1, errno, "Unable to allocate lookup");
+	for (i = 0; i < 2; i++)
+		if (want[i] != -1 && index_runs(idx, idxlen, nblocks, nids,
+		    i == 0 ? 'u' : 'g', (uint32_t) want[i], blocks,
+		    want[0] != -1 && want[1] != -1) == -1)
+			error(1, -1, "'%s': invalid index", ipath);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		error(1, errno, "Unable to open '%s'", path);
+	bin = pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)
+	    && memcmp(magic, FIST_BIN_MAGIC, sizeof(magic)) == 0;
+	if (bin)
+		fwrite(FIST_BIN_MAGIC, FIST_BIN_MAGICLEN, 1, stdout);
+
+	for (b = 0; b < nblocks; b = last) {
+		if (blocks[b] != 3) {
+			last = b + 1;
+			continue;
+		}
+		/* Consecutive blocks are read at once */
+		for (last = b + 1; last < nblocks && blocks[last] == 3; last++)
+			;
+		first = GET64(idx + FIST_IDX_HDRLEN + b * 8);
+		len = (size_t) (GET64(idx + FIST_IDX_HDRLEN + last * 8)
+		    - first);
+		if (first + len > dumpsize)
+			error(1, -1, "'%s': invalid index", ipath);
+		if (len > buflen) {
+			buflen = len;
+			if ((buf = realloc(buf, buflen)) == NULL)
+				error(1, errno, "Unable to allocate lookup");
+		}
+		if (pread(fd, buf, len, (off_t) first) != (ssize_t) len)
+			error(1, errno, "Unable to read '%s' (changed since "
+			    "indexed?)", path);
+		nread += len;
+
+		for (p = buf, end = buf + len; p < end; p = rec) {
+			if (bin) {
+				if (end - p < FIST_BIN_HDRLEN)
+					break;
+				rec = p + FIST_BIN_HDRLEN + GET32(p + 56)
+				    + GET32(p + 60);
+				uid = GET32(p + 48);
+				gid = GET32(p + 52);
+			} else {
+				if ((rec = memchr(p, '\n', (size_t) (end - p)))
+				    == NULL)
+					break;
+				rec++;
+				text_owner(p, rec, &uid, &gid);
+			}
+			if (rec > end)
+				break;
+			if ((want[0] == -1 || uid == (uint64_t) want[0])
+			    && (want[1] == -1 || gid == (uint64_t) want[1])) {
+				fwrite(p, (size_t) (rec - p), 1, stdout);
+				nrecs++;
+			}
+		}
+		if (p != end)
+			error(1, -1, "'%s': record not on a block boundary "
+			    "(changed since indexed?)", path);
+	}
+	close(fd);
+	if (fflush(stdout) == EOF)
+		error(1, errno, "Error while writing to stdout");
+
+	for (b = n = 0; b < nblocks; b++)
+		n += blocks[b] == 3;
+	if (verbose)
+		fprintf(stderr, "fist: %" PRIu64 " records, %" PRIu64 " of %"
+		    PRIu64 " blocks, %" PRIu64 " of %" PRIu64 " bytes read\n",
+		    nrecs, n, nblocks, nread, dumpsize);
+
+	free(buf);
+	free(blocks);
+	free(idx);
+	free(ipath);
+	free(spec);
+
+	return (0);
+}
+
+
+/*
+ * Mark the blocks of ("kind", "id") in "blocks" (3 is a match): with
+ * "both" (UID and GID lookup) bit 0 is set for the UID and bit 1 for the
+ * GID.
+ */
+static int
+index_runs(const unsigned char *idx, const size_t idxlen,
+    const uint64_t nblocks, const uint64_t nids, const int kind,
+    const uint32_t id, unsigned char *blocks, const int both)
+{
+	const unsigned char	*ents = NULL, *e = NULL, *p = NULL, *end;
+	const unsigned char	*runs = NULL;
+	uint64_t		 lo = 0, hi = nids, mid, gap, count, b = 0;
+	uint64_t		 off, len;
+	int			 k;
+
+	ents = idx + FIST_IDX_HDRLEN + (nblocks + 1) * 8;
+	runs = ents + nids * FIST_IDX_ENTLEN;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = ents + mid * FIST_IDX_ENTLEN;
+		k = (int) GET32(e);
+		if (k == kind && GET32(e + 4) == id)
+			break;
+		if (k > kind || (k == kind && GET32(e + 4) < id))
+			lo = mid + 1;
+		else
+			hi = mid;
+		e = NULL;
+	}
+	if (e == NULL)
+		return (0);	/* no object */
+
+	off = GET64(e + 16);
+	len = GET64(e + 24);
+	if (off > idxlen || len > idxlen - off
+	    || (size_t) (runs - idx) > idxlen - off - len)
+		return (-1);
+	for (p = runs + off, end = p + len; p < end; b += count) {
+		if (leb128_get(&p, end, &gap) == -1
+		    || leb128_get(&p, end, &count) == -1)
+			return (-1);
+		b += gap;
+		if (b > nblocks || count > nblocks - b)
+			return (-1);
+		for (mid = b; mid < b + count; mid++)
+			blocks[mid] |= both ? (kind == 'u' ? 1 : 2) : 3;
+	}
+
+	return (0);
+}
+
+
+/*
+ * UID and GID of a text dump line.
+ */
+static void
+text_owner(const unsigned char *p, const unsigned char *end, uint64_t *uid,
+    uint64_t *gid)
+{
+	int	field;
+
+	*uid = *gid = UINT64_MAX;
+	for (field = 0; field < 3 && p < end; p++)
+		if (*p == ':')
+			field++;
+	for (*uid = 0; p < end && *p >= '0' && *p <= '9'; p++)
+		*uid = *uid * 10 + (uint64_t) (*p - '0');
+	if (p < end && *p++ == ':')
+		for (*gid = 0; p < end && *p >= '0' && *p <= '9'; p++)
+			*gid = *gid * 10 + (uint64_t) (*p - '0');
+}
+
+
+/*
+ * Whole content of file "path" (allocated), its length in "len".
+ */
+static unsigned char *
+read_file(const char *path, size_t *len)
+{
+	unsigned char	*buf = NULL;
+	FIST_SSTAT	 st;
+	ssize_t		 n;
+	int		 fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		error(1, errno, "Unable to open '%s'", path);
+	if (FIST_FSTAT(fd, &st) == -1)
+		error(1, errno, "Unable to stat '%s'", path);
+	if ((buf = malloc((size_t) st.st_size + 1)) == NULL)
+		error(1, errno, "Unable to allocate '%s'", path);
+	for (*len = 0; *len < (size_t) st.st_size; *len += (size_t) n)
+		if ((n = read(fd, buf + *len, (size_t) st.st_size - *len))
+		    <= 0)
+			error(1, n == 0 ? -1 : errno, "Unable to read '%s'",
+			    path);
+	close(fd);
+
+	return (buf);
+}
+
+
+/*
+ * Per file name suffix (".tar", ".h5", etc.) and UID statistics on files,
+ * written as JSON when the traversal is complete.
+ */
+static void
+exts_open(struct sink *s)
+{
+	struct exts	*x = NULL;
+
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	x->max = budget_fit(2 * EXT_MAX_KEYS * sizeof(*x->tab),
+	    2 * EXT_MIN_KEYS * sizeof(*x->tab), BUDGET_EXT)
+	    / (2 * sizeof(*x->tab));
+	if ((x->tab = calloc(2 * x->max, sizeof(*x->tab))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	s->data = x;
+
+	sink_stream_open(s);
+}
+
+
+static void
+exts_emit(struct sink *s, const struct fist_obj *o)
+{
+	struct exts		*x = s->data;
+	struct ext		*e = NULL;
+	const FIST_SSTAT	*st = o->st;
+	const char		*dot = NULL;
+	char			 ext[EXT_MAXLEN + 1];
+	uint32_t		 h = 2166136261U;
+	size_t			 i, len = 0;
+
+	if (!S_ISREG(st->st_mode))
+		return;
+
+	/* No suffix for ".name" nor "name." */
+	if ((dot = strrchr(o->name, '.')) != NULL && dot != o->name
+	    && dot[1] != '\0' && strlen(dot + 1) <= EXT_MAXLEN)
+		for (dot++; len < EXT_MAXLEN && dot[len] != '\0'; len++)
+			ext[len] = (char) tolower((unsigned char) dot[len]);
+	ext[len] = '\0';
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) ext[i]) * 16777619U;
+	h = (h ^ (uint32_t) st->st_uid) * 16777619U;
+
+	for (i = h & (2 * x->max - 1); x->tab[i].used;
+	    i = (i + 1) & (2 * x->max - 1))
+		if (x->tab[i].uid == (uint32_t) st->st_uid
+		    && strcmp(x->tab[i].ext, ext) == 0)
+			break;
+	e = &x->tab[i];
+	if (!e->used) {
+		if (x->count == x->max)
+			e = &x->other;
+		else {
+			e->used = 1;
+			e->uid = (uint32_t) st->st_uid;
+			memcpy(e->ext, ext, len + 1);
+			x->count++;
+		}
+	}
+
+	if (e->nfiles == 0 || st->st_mtime < e->oldest)
+		e->oldest = st->st_mtime;
+	if (e->nfiles == 0 || st->st_mtime > e->newest)
+		e->newest = st->st_mtime;
+	if (st->st_atime > e->latime)
+		e->latime = st->st_atime;
+	e->nfiles++;
+	e->bytes += (uint64_t) st->st_size;
+	e->kib += (uint64_t) ((st->st_blocks + 1) >> 1);
+}
+
+
+static void
+exts_close(struct sink *s)
+{
+	struct exts	*x = s->data;
+	struct ext	*e = NULL;
+	size_t		 i, n;
+	int		 other;
+
+	/* Largest first, "other" last (without suffix nor UID) */
+	for (i = n = 0; i < 2 * x->max; i++)
+		if (x->tab[i].used)
+			x->tab[n++] = x->tab[i];
+	qsort(x->tab, n, sizeof(*x->tab), ext_cmp);
+	if (x->other.nfiles > 0)
+		x->tab[n++] = x->other;
+
+	fprintf(s->fp, "{\n    \"suffixes\": [\n");
+	for (i = 0; i < n; i++) {
+		e = &x->tab[i];
+		other = i + 1 == n && x->other.nfiles > 0;
+		fprintf(s->fp, "        {\n            \"suffix\": ");
+		print_json_string(s->fp, other ? NULL : e->ext);
+		fprintf(s->fp, ",\n");
+		if (!other)
+			fprintf(s->fp, "            \"uid\": %" PRIu32 ",\n",
+			    e->uid);
+		fprintf(s->fp, "            \"nfiles\": %" PRIu64 ",\n"
+		    "            \"bytes\": %" PRIu64 ",\n"
+		    "            \"kib\": %" PRIu64 ",\n"
+		    "            \"oldest\": %lld,\n"
+		    "            \"newest\": %lld,\n"
+		    "            \"latime\": %lld\n"
+		    "        }%s\n",
+		    e->nfiles, e->bytes, e->kib, (long long) e->oldest,
+		    (long long) e->newest, (long long) e->latime,
+		    i + 1 < n ? "," : "");
+	}
+	fprintf(s->fp, "    ]\n}\n");
+	sink_stream_close(s);
+
+	free(x->tab);
+	free(x);
+}
+
+
+static int
+ext_cmp(const void *a, const void *b)
+{
+	const struct ext	*ea = a, *eb = b;
+	int			 r;
+
+	if (ea->bytes != eb->bytes)
+		return (ea->bytes < eb->bytes ? 1 : -1);
+	if ((r = strcmp(ea->ext, eb->ext)) != 0)
+		return (r);
+	return (ea->uid < eb->uid ? -1 : (ea->uid > eb->uid));
+}
+
+
+/*
+ * Per UID ("byuid") or per GID ("bygid") text dumps, in directory
+ * "s->path".
+ */
+static void
+parts_open(struct sink *s)
+{
+	struct parts	*pt = NULL;
+
+	if (mkdir(s->path, 0777) == -1 && errno != EEXIST)
+		error(1, errno, "Unable to create directory '%s'", s->path);
+
+	if ((pt = calloc(1, sizeof(*pt))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	pt->bygid = (strcmp(s->type->name, "bygid") == 0);
+	pt->size = 1024;
+	if ((pt->tab = calloc(pt->size, sizeof(*pt->tab))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	s->data = pt;
+}
+
+
+static struct part *
+part_lookup(struct parts *pt, const uint32_t id)
+{
+	struct part	**old = NULL, *p = NULL;
+	size_t		  i, j, oldsize;
+
+	/* Keep the table at most half full */
+	if (pt->count * 2 >= pt->size) {
+		old = pt->tab;
+		oldsize = pt->size;
+		pt->size *= 2;
+		if ((pt->tab = calloc(pt->size, sizeof(*pt->tab))) == NULL)
+			error(1, errno, "Unable to allocate output");
+		for (i = 0; i < oldsize; i++) {
+			if (old[i] == NULL)
+				continue;
+			for (j = (old[i]->id * 2654435761U) & (pt->size - 1);
+			    pt->tab[j] != NULL; j = (j + 1) & (pt->size - 1))
+				;
+			pt->tab[j] = old[i];
+		}
+		free(old);
+	}
+
+	for (i = (id * 2654435761U) & (pt->size - 1); pt->tab[i] != NULL;
+	    i = (i + 1) & (pt->size - 1))
+		if (pt->tab[i]->id == id)
+			return (pt->tab[i]);
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	p->id = id;
+	pt->tab[i] = p;
+	pt->count++;
+
+	return (p);
+}
+
+
+static void
+parts_emit(struct sink *s, const struct fist_obj *o)
+{
+	struct parts	*pt = s->data;
+	struct part	*p = NULL;
+	char		 path[PATH_MAX];
+
+	p = part_lookup(pt, pt->bygid ? (uint32_t) o->st->st_gid
+	    : (uint32_t) o->st->st_uid);
+
+	if (p->fp == NULL) {
+		if (pt->nopen == s->maxfiles)
+			part_close(s, pt->tail);
+		/* Write and close files for the buffer of this one */
+		while (s->bufsize > 0 && pt->nopen > 0
+		    && budget_take(s->bufsize, 0) == -1) {
+			part_close(s, pt->tail);
+			atomic_fetch_or(&budget.degraded, BUDGET_FILES);
+		}
+		if (s->bufsize > 0 && pt->nopen == 0)
+			budget_take(s->bufsize, 1);
+		snprintf(path, sizeof(path), "%s/%" PRIu32 ".fist", s->path,
+		    p->id);
+		if ((p->fp = fopen(path, p->created ? "a" : "w")) == NULL)
+			error(1, errno, "Unable to open output file '%s'",
+			    path);
+		if (s->bufsize > 0) {
+			if ((p->buf = malloc(s->bufsize)) == NULL)
+				error(1, errno, "Unable to allocate output "
+				    "buffer");
+			setvbuf(p->fp, p->buf, _IOFBF, s->bufsize);
+		}
+		pt->reopens += p->created;
+		p->created = 1;
+		pt->nopen++;
+	} else if (p != pt->head) {
+		/* Unlink, to move it first */
+		p->prev->next = p->next;
+		if (p->next != NULL)
+			p->next->prev = p->prev;
+		else
+			pt->tail = p->prev;
+	}
+	if (p != pt->head) {
+		p->prev = NULL;
+		if ((p->next = pt->head) != NULL)
+			pt->head->prev = p;
+		pt->head = p;
+		if (pt->tail == NULL)
+			pt->tail = p;
+	}
+
+	print_metadata(p->fp, o);
+}
+
+
+/*
+ * Close an open partition file (removing it from the LRU list).
+ */
+static void
+part_close(struct sink *s, struct part *p)
+{
+	struct parts	*pt = s->data;
+
+	if (p->prev != NULL)
+		p->prev->next = p->next;
+	else
+		pt->head = p->next;
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	else
+		pt->tail = p->prev;
+	p->prev = p->next = NULL;
+
+	PROBE2(flush_entry, s->type->name, s->path);
+	if (fclose(p->fp) == EOF)
+		error(1, errno, "Error while writing to '%s/%" PRIu32 ".fist'",
+		    s->path, p->id);
+	PROBE2(flush_return, s->type->name, s->path);
+	p->fp = NULL;
+	if (p->buf != NULL)
+		budget_give(s->bufsize);
+	free(p->buf);
+	p->buf = NULL;
+	pt->nopen--;
+}
+
+
+static void
+parts_close(struct sink *s)
+{
+	struct parts	*pt = s->data;
+	size_t		 i;
+
+	while (pt->head != NULL)
+		part_close(s, pt->head);
+
+	if (verbose)
+		fprintf(stderr, "fist: %s: %zu files, %" PRIu64 " reopened\n",
+		    s->path, pt->count, pt->reopens);
+
+	for (i = 0; i < pt->size; i++)
+		free(pt->tab[i]);
+	free(pt->tab);
+	free(pt);
+}
+
+
+/*
+ * UID and GID to name table of the owners of the objects, written when
+ * the traversal is complete: "u:UID:name" and "g:GID:name" lines (names
+ * percent-encoded, empty for unknown IDs).
+ */
+static void
+ids_emit(struct sink *s, const struct fist_obj *o)
+{
+	(void) s;
+	idcache_lookup('u', (uint32_t) o->st->st_uid);
+	idcache_lookup('g', (uint32_t) o->st->st_gid);
+}
+
+
+static void
+ids_close(struct sink *s)
+{
+	struct idname	*tab = NULL;
+	const char	*c = NULL;
+	size_t		 i, n;
+
+	/* Sorted copy, the cache may still be used by other outputs */
+	if ((tab = calloc(idcache.count + 1, sizeof(*tab))) == NULL)
+		error(1, errno, "Unable to allocate output");
+	for (i = n = 0; i < idcache.size; i++)
+		if (idcache.tab[i].kind != 0)
+			tab[n++] = idcache.tab[i];
+	qsort(tab, n, sizeof(*tab), idname_cmp);
+
+	for (i = 0; i < n; i++) {
+		fprintf(s->fp, "%c:%" PRIu32 ":", tab[i].kind, tab[i].id);
+		for (c = tab[i].name; c != NULL && *c != '\0'; c++)
+			print_percent_encoded_char(*c, s->fp);
+		fputc('\n', s->fp);
+	}
+	sink_stream_close(s);
+
+	if (verbose)
+		fprintf(stderr, "fist: %zu IDs, %" PRIu64 " name lookups\n",
+		    n, idcache.lookups);
+	free(tab);
+}
+
+
+/*
+ * Cached name of UID ('u' kind) or GID ('g' kind) "id", resolved with
+ * getpwuid_r(3)/getgrgid_r(3) when first seen.
+ */
+static struct idname *
+idcache_lookup(const int kind, const uint32_t id)
+{
+	struct idname	*old = NULL, *e = NULL;
+	struct passwd	 pw, *pwp = NULL;
+	struct group	 gr, *grp = NULL;
+	static char	*buf = NULL;
+	static size_t	 bufsize = 16384;
+	size_t		 i, oldsize;
+	int		 r;
+
+#define IDCACHE_SLOT(k, i)	(&idcache.tab[(((i) ^ (uint32_t) (k))	\
+				    * 2654435761U) & (idcache.size - 1)])
+#define IDCACHE_NEXT(e)		((e) + 1 < idcache.tab + idcache.size	\
+				    ? (e) + 1 : idcache.tab)
+
+	if (idcache.count * 2 >= idcache.size) {
+		old = idcache.tab;
+		oldsize = idcache.size;
+		idcache.size = oldsize == 0 ? 256 : oldsize * 2;
+		if ((idcache.tab = calloc(idcache.size,
+		    sizeof(*idcache.tab))) == NULL)
+			error(1, errno, "Unable to allocate IDs cache");
+		budget_take((idcache.size - oldsize) * sizeof(*idcache.tab),
+		    1);
+		for (i = 0; i < oldsize; i++) {
+			if (old[i].kind == 0)
+				continue;
+			for (e = IDCACHE_SLOT(old[i].kind, old[i].id);
+			    e->kind != 0; e = IDCACHE_NEXT(e))
+				;
+			*e = old[i];
+		}
+		free(old);
+	}
+
+	for (e = IDCACHE_SLOT(kind, id); e->kind != 0; e = IDCACHE_NEXT(e))
+		if (e->id == id && e->kind == kind) {
+			if (e->failures == 0 || e->failures >= IDCACHE_TRIES)
+				return (e);
+			break;
+		}
+
+	/* Not cached yet, or the previous lookups failed */
+	if (buf == NULL && (buf = malloc(bufsize)) == NULL)
+		error(1, errno, "Unable to allocate IDs cache");
+	idcache.lookups++;
+	for (;;) {
+		if (kind == 'u')
+			r = getpwuid_r((uid_t) id, &pw, buf, bufsize, &pwp);
+		else
+			r = getgrgid_r((gid_t) id, &gr, buf, bufsize, &grp);
+		if (r != ERANGE)
+			break;
+		bufsize *= 2;
+		if ((buf = realloc(buf, bufsize)) == NULL)
+			error(1, errno, "Unable to allocate IDs cache");
+	}
+
+	if (e->kind == 0) {
+		e->kind = kind;
+		e->id = id;
+		e->name = NULL;
+		idcache.count++;
+	}
+	/* Unknown only when the lookup worked without a result */
+	if (r != 0) {
+		warning(r, "Unable to get the name of %s %" PRIu32,
+		    kind == 'u' ? "UID" : "GID", id);
+		e->failures++;
+		return (e);
+	}
+	e->failures = 0;
+	if (kind == 'u' && pwp != NULL)
+		e->name = strdup(pw.pw_name);
+	else if (kind == 'g' && grp != NULL)
+		e->name = strdup(gr.gr_name);
+	if ((pwp != NULL || grp != NULL) && e->name == NULL)
+		error(1, errno, "Unable to allocate IDs cache");
+
+#undef IDCACHE_SLOT
+#undef IDCACHE_NEXT
+
+	return (e);
+}
+
+
+static int
+idname_cmp(const void *a, const void *b)
+{
+	const struct idname	*ia = a, *ib = b;
+
+	if (ia->kind != ib->kind)
+		return (ib->kind - ia->kind);	/* 'u' first */
+	return (ia->id < ib->id ? -1 : (ia->id > ib->id));
+}
+
+
+/*
+ * JSON string, or null.  The bytes which are not UTF-8 are written as
+ * lone surrogates "\udcXX" (as Python's "surrogateescape" does), so the
+ * output is valid JSON and the raw name can be recovered.
+ */
+static void
+print_json_string(FILE *fp, const char *str)
+{
+	const unsigned char	*c = NULL;
+	size_t			 n;
+
+	if (str == NULL) {
+		fputs("null", fp);
+		return;
+	}
+
+	fputc('"', fp);
+	for (c = (const unsigned char *) str; *c != '\0'; c += n) {
+		n = 1;
+		if (*c == '"' || *c == '\\')
+			fprintf(fp, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(fp, "\\u%04x", *c);
+		else if (*c < 0x80)
+			fputc(*c, fp);
+		else if ((n = utf8_len(c)) > 0)
+			fwrite(c, 1, n, fp);
+		else {
+			n = 1;
+			fprintf(fp, "\\udc%02x", *c);
+		}
+	}
+	fputc('"', fp);
+}
+
+
+/*
+ * Length of the (non-ASCII) UTF-8 sequence at "c", 0 if it isn't valid.
+ */
+static size_t
+utf8_len(const unsigned char *c)
+{
+	uint32_t	 cp;
+	size_t		 n, i;
+
+	if (*c >= 0xc2 && *c <= 0xdf) {
+		n = 2;
+		cp = *c & 0x1f;
+	} else if ((*c & 0xf0) == 0xe0) {
+		n = 3;
+		cp = *c & 0x0f;
+	} else if (*c >= 0xf0 && *c <= 0xf4) {
+		n = 4;
+		cp = *c & 0x07;
+	} else
+		return (0);
+
+	for (i = 1; i < n; i++) {
+		if ((c[i] & 0xc0) != 0x80)
+			return (0);
+		cp = cp << 6 | (c[i] & 0x3f);
+	}
+	/* Overlong forms, surrogates and beyond U+10FFFF */
+	if ((n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff)))
+	    || (n == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+		return (0);
+
+	return (n);
+}
+
+
+static void
+counters_add(struct counters *c, const FIST_SSTAT *st)
+{
+	if (S_ISREG(st->st_mode))
+		c->nfiles++;
+	else if (S_ISDIR(st->st_mode))
+		c->ndirs++;
+	else if (S_ISLNK(st->st_mode))
+		c->nsymlinks++;
+	else
+		c->nothers++;
+
+	c->bytes += (uint64_t) st->st_size;
+	c->kib += (uint64_t) ((st->st_blocks + 1) >> 1);
+	if (st->st_atime > c->latime)
+		c->latime = st->st_atime;
+	if (st->st_mtime > c->lmtime)
+		c->lmtime = st->st_mtime;
+	if (st->st_ctime > c->lctime)
+		c->lctime = st->st_ctime;
+}
+
+
+static void
+print_counters_json(FILE *fp, const struct counters *c, const char *in)
+{
+	fprintf(fp, "%s\"nfiles\": %" PRIu64 ",\n", in, c->nfiles);
+	fprintf(fp, "%s\"ndirs\": %" PRIu64 ",\n", in, c->ndirs);
+	fprintf(fp, "%s\"nsymlinks\": %" PRIu64 ",\n", in, c->nsymlinks);
+	fprintf(fp, "%s\"nothers\": %" PRIu64 ",\n", in, c->nothers);
+	fprintf(fp, "%s\"bytes\": %" PRIu64 ",\n", in, c->bytes);
+	fprintf(fp, "%s\"kib\": %" PRIu64 ",\n", in, c->kib);
+	fprintf(fp, "%s\"latime\": %lld,\n", in, (long long) c->latime);
+	fprintf(fp, "%s\"lmtime\": %lld,\n", in, (long long) c->lmtime);
+	fprintf(fp, "%s\"lctime\": %lld\n", in, (long long) c->lctime);
+}
+
+
+/*
+ * Load the projects file: one "name path" per line, "path" being the
+ * absolute name of the project root directory (the rest of the line).
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static void
+load_projects(const char *file)
+{
+	FILE		*fp = NULL;
+	char		 line[PATH_MAX + 256], *name = NULL, *path = NULL;
+	char		*comp = NULL, *last = NULL;
+	struct pnode	*pn = NULL;
+	size_t		 lineno = 0;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		error(1, errno, "Unable to open projects file '%s'", file);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((name = strtok_r(line, " \t\n", &last)) == NULL
+		    || name[0] == '#')
+			continue;
+		path = last + strspn(last, " \t");
+		path[strcspn(path, "\n")] = '\0';
+		if (path[0] != '/')
+			error(1, -1, "%s:%zu: absolute project root required",
+			    file, lineno);
+		if (strchr(name, '"') != NULL || strchr(name, '\\') != NULL)
+			error(1, -1, "%s:%zu: invalid project name", file,
+			    lineno);
+
+		pn = &ptrie;
+		for (comp = strtok_r(path, "/", &last); comp != NULL;
+		    comp = strtok_r(NULL, "/", &last))
+			if (strcmp(comp, ".") != 0)
+				pn = pnode_child(pn, comp, 1);
+		if (pn->project != -1)
+			error(1, -1, "%s:%zu: duplicate project root", file,
+			    lineno);
+
+		if ((pnames = realloc(pnames,
+		    (nprojects + 1) * sizeof(*pnames))) == NULL
+		    || (pnames[nprojects] = strdup(name)) == NULL)
+			error(1, errno, "Unable to allocate project");
+		pn->project = (int) nprojects++;
+	}
+	if (ferror(fp))
+		error(1, errno, "Error while reading '%s'", file);
+	fclose(fp);
+}
+
+
+/*
+ * Child "name" of trie node "pn" (added when "create" is set), NULL if
+ * not found.
+ */
+static struct pnode *
+pnode_child(const struct pnode *pn, const char *name, const int create)
+{
+	struct pnode	*c = NULL;
+	size_t		 lo = 0, hi = pn->nchildren, mid;
+	int		 cmp;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((cmp = strcmp(name, pn->children[mid].name)) == 0)
+			return (&pn->children[mid]);
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (!create)
+		return (NULL);
+
+	/* Only while loading the projects: the trie is not const yet */
+	c = (struct pnode *) pn;
+	if ((c->children = realloc(c->children,
+	    (c->nchildren + 1) * sizeof(*c->children))) == NULL)
+		error(1, errno, "Unable to allocate project");
+	memmove(&c->children[lo + 1], &c->children[lo],
+	    (c->nchildren - lo) * sizeof(*c->children));
+	c->nchildren++;
+	c = &c->children[lo];
+	if ((c->name = strdup(name)) == NULL)
+		error(1, errno, "Unable to allocate project");
+	c->project = -1;
+	c->nchildren = 0;
+	c->children = NULL;
+
+	return (c);
+}
+
+
+/*
+ * Trie node of the traversal root "dir" (NULL if there's no project root
+ * in it), "project" is set to the project the root belongs to.
+ * A "virtual" root (ext4 image mount point) may not exist.
+ */
+static const struct pnode *
+pnode_root(const char *dir, int *project, const int virtual)
+{
+	char			*path = NULL, *comp = NULL, *last = NULL;
+	const struct pnode	*pn = &ptrie;
+
+	*project = -1;
+	if (nprojects == 0)
+		return (NULL);
+
+	if ((path = realpath(dir, NULL)) == NULL && (!virtual || errno != ENOENT
+	    || (path = strdup(dir)) == NULL))
+		error(1, errno, "Unable to get the absolute name of '%s'", dir);
+
+	for (comp = strtok_r(path, "/", &last); comp != NULL && pn != NULL;
+	    comp = strtok_r(NULL, "/", &last)) {
+		if ((pn = pnode_child(pn, comp, 0)) != NULL
+		    && pn->project != -1)
+			*project = pn->project;
+	}
+	free(path);
+
+	return (pn);
+}
+
+
+void
+verror(const int errnum, const char *fmt, va_list ap)
+{
+	char *errmsg = NULL;
+
+	if (errnum != -1)
+		errmsg = strerror(errnum);
+
+	/* Messages may come from several threads */
+	flockfile(stderr);
+	fprintf(stderr, "fist: ");
+	if (fmt != NULL)
+		vfprintf(stderr, fmt, ap);
+
+	if (errnum != -1) {
+		fprintf(stderr, ": %.100s (%d)\n", errmsg, errnum);
+	} else {
+		fputc('\n', stderr);
+	}
+	funlockfile(stderr);
+}
+
+
+void
+error(const int excode, const int errnum, const char *fmt, ...)
+{
 	va_list ap;
 
+#ifdef FIST_EMBEDDED
+	if (error_jmp != NULL) {
+		if (atomic_exchange(&error_raised, 1) == 0) {
+			va_start(ap, fmt);
+			vsnprintf(error_msg, sizeof(error_msg), fmt, ap);
+			va_end(ap);
+			error_errnum = errnum;
+		}
+		longjmp(*error_jmp, 1);
+	}
+#endif /* FIST_EMBEDDED */
+
 	va_start(ap, fmt);
 	verror(errnum, fmt, ap);
 	va_end(ap);
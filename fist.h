@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2006-2024 IN2P3 Computing Centre
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * Dump formats, shared by "fist" and "fist-convert".
+ */
+
+#ifndef FIST_H
+#define FIST_H
+
+#include <ctype.h>
+#include <stdint.h>
+
+/*
+ * Binary output records: a fixed size header (little-endian, with the full
+ * "struct stat" values unlike the text output), followed by the raw (not
+ * percent-encoded) full name and symlink value.
+ * Header: KiB allocated, size, mtime, atime, ctime (64 bits), then mode,
+ * link count, UID, GID, name length and symlink value length (32 bits).
+ * The file starts with FIST_BIN_MAGIC.
+ */
+#define FIST_BIN_MAGIC		"FISTBIN1"
+#define FIST_BIN_MAGICLEN	8
+#define FIST_BIN_HDRLEN		64
+
+/* Little-endian encoding (binary records, history, ext4 images) */
+#define PUT32(p, v)	do {						\
+	(p)[0] = (unsigned char) (v);					\
+	(p)[1] = (unsigned char) ((v) >> 8);				\
+	(p)[2] = (unsigned char) ((v) >> 16);				\
+	(p)[3] = (unsigned char) ((v) >> 24);				\
+} while (0)
+#define PUT64(p, v)	do {						\
+	PUT32((p), (uint32_t) (v));					\
+	PUT32((p) + 4, (uint32_t) ((uint64_t) (v) >> 32));		\
+} while (0)
+#define GET16(p)	((uint16_t) ((p)[0] | (p)[1] << 8))
+#define GET32(p)	((uint32_t) (p)[0] | (uint32_t) (p)[1] << 8		\
+			    | (uint32_t) (p)[2] << 16 | (uint32_t) (p)[3] << 24)
+#define GET64(p)	((uint64_t) GET32(p) | (uint64_t) GET32((p) + 4) << 32)
+
+/*
+ * Characters percent-encoded in the text output names (RFC3986 like,
+ * except '/', and the non printable characters).
+ */
+static inline int
+fist_encoded(const unsigned char c)
+{
+	switch (c) {
+	case '\b':
+	case '\n':
+	case '\r':
+	case '\t':
+	case ' ':
+	case '!':
+	case '"':
+	case '#':
+	case '$':
+	case '%':
+	case '&':
+	case '\'':
+	case '(':
+	case ')':
+	case '*':
+	case '+':
+	case ',':
+	case ':':
+	case ';':
+	case '<':
+	case '=':
+	case '>':
+	case '?':
+	case '@':
+	case '[':
+	case '\\':
+	case ']':
+	case '`':
+	case '{':
+	case '|':
+	case '}':
+	case '~':
+	case 27:	/* ESC */
+	case 127:	/* DEL */
+		return (1);
+	default:
+		return (!isprint(c));
+	}
+}
+
+#endif /* FIST_H */
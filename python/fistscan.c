@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2006-2024 IN2P3 Computing Centre
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * "fistscan" Python module: the fist traversal (fist.c, built in without
+ * its main()) feeding a "columns" output, an array per metadata field,
+ * returned as buffer protocol objects (NumPy arrays without copy).
+ *
+ *   >>> import fistscan, numpy as np
+ *   >>> cols = fistscan.scan("/data", jobs=16)
+ *   >>> size = np.asarray(cols["size"])
+ *
+ * The scan runs with the GIL released (one scan at a time per process).
+ * Names are "names" (the full names, not percent-encoded, concatenated)
+ * and "name_offsets" (the start of each name in "names", and its end).
+ * Invalid arguments raise ValueError, the errors which end fist (error())
+ * raise OSError, MemoryError or RuntimeError instead: fist.c is built with
+ * FIST_EMBEDDED, error() then jumps back to columns_scan().
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define FIST_EMBEDDED
+#include "../fist.c"
+
+/* Columns: name, buffer protocol format and size of an element */
+#define COL_UID		0
+#define COL_GID		1
+#define COL_MODE	2
+#define COL_NLINK	3
+#define COL_SIZE	4
+#define COL_BLOCKS	5
+#define COL_ATIME	6
+#define COL_MTIME	7
+#define COL_CTIME	8
+#define COL_OFFSETS	9
+#define COL_NAMES	10
+#define NCOLS		11
+
+static const struct coldef {
+	const char	*name;
+	const char	*format;
+	size_t		 itemsize;
+} coldefs[NCOLS] = {
+	{ "uid",		"I",	sizeof(uint32_t) },
+	{ "gid",		"I",	sizeof(uint32_t) },
+	{ "mode",		"I",	sizeof(uint32_t) },
+	{ "nlink",		"I",	sizeof(uint32_t) },
+	{ "size",		"q",	sizeof(int64_t) },
+	{ "blocks",		"q",	sizeof(int64_t) },	/* 512 bytes */
+	{ "atime",		"q",	sizeof(int64_t) },
+	{ "mtime",		"q",	sizeof(int64_t) },
+	{ "ctime",		"q",	sizeof(int64_t) },
+	{ "name_offsets",	"Q",	sizeof(uint64_t) },
+	{ "names",		"B",	1 },
+};
+
+/* "columns" output data, filled by the output thread */
+struct columns {
+	char		*data[NCOLS];
+	size_t		 len[NCOLS];	/* bytes */
+	size_t		 size[NCOLS];	/* allocated */
+	size_t		 nobjs;
+	int		 nomem;		/* an allocation failed */
+};
+
+/* A column, as a (read-only, one dimension) buffer protocol object */
+typedef struct {
+	PyObject_HEAD
+	char		*data;
+	Py_ssize_t	 len;		/* elements */
+	Py_ssize_t	 itemsize;
+	const char	*format;
+} Column;
+
+static int col_put(struct columns *, const int, const void *, const size_t);
+static void columns_open(struct sink *);
+static void columns_emit(struct sink *, const struct fist_obj *);
+static void columns_close(struct sink *);
+static void columns_free(struct columns *);
+static int profile_check(const char *);
+static int columns_scan(const char *, const unsigned, const char *,
+	struct columns *);
+static PyObject *column_new(struct columns *, const int);
+static void column_dealloc(PyObject *);
+static int column_getbuffer(PyObject *, Py_buffer *, int);
+static Py_ssize_t column_length(PyObject *);
+static PyObject *fistscan_scan(PyObject *, PyObject *, PyObject *);
+
+static PyTypeObject ColumnType;
+
+static const struct sink_type columns_type = {
+	"columns", 0, 0, columns_open, columns_emit, columns_close
+};
+
+/* The traversal state is global */
+static pthread_mutex_t	scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Append "len" bytes to column "i", growing it (by doubling).
+ */
+static int
+col_put(struct columns *c, const int i, const void *p, const size_t len)
+{
+	char	*data = NULL;
+	size_t	 size = c->size[i];
+
+	if (c->len[i] + len > size) {
+		while (c->len[i] + len > size)
+			size = size == 0 ? 64 * 1024 : size * 2;
+		if ((data = realloc(c->data[i], size)) == NULL) {
+			c->nomem = 1;
+			return (-1);
+		}
+		c->data[i] = data;
+		c->size[i] = size;
+	}
+	memcpy(c->data[i] + c->len[i], p, len);
+	c->len[i] += len;
+
+	return (0);
+}
+
+
+static void
+columns_open(struct sink *s)
+{
+	uint64_t	 off = 0;
+
+	col_put(s->data, COL_OFFSETS, &off, sizeof(off));
+}
+
+
+static void
+columns_emit(struct sink *s, const struct fist_obj *o)
+{
+	struct columns		*c = s->data;
+	const FIST_SSTAT	*st = o->st;
+	uint32_t		 u32[4];
+	int64_t			 i64[5];
+	uint64_t		 off;
+	int			 i;
+
+	/* Stop at the first allocation failure, the scan is unusable */
+	if (c->nomem)
+		return;
+
+	u32[0] = (uint32_t) st->st_uid;
+	u32[1] = (uint32_t) st->st_gid;
+	u32[2] = (uint32_t) st->st_mode;
+	u32[3] = (uint32_t) st->st_nlink;
+	i64[0] = (int64_t) st->st_size;
+	i64[1] = (int64_t) st->st_blocks;
+	i64[2] = (int64_t) st->st_atime;
+	i64[3] = (int64_t) st->st_mtime;
+	i64[4] = (int64_t) st->st_ctime;
+	for (i = COL_UID; i <= COL_NLINK; i++)
+		col_put(c, i, &u32[i - COL_UID], sizeof(*u32));
+	for (i = COL_SIZE; i <= COL_CTIME; i++)
+		col_put(c, i, &i64[i - COL_SIZE], sizeof(*i64));
+
+	if (o->parent != NULL) {
+		col_put(c, COL_NAMES, o->parent, strlen(o->parent));
+		col_put(c, COL_NAMES, "/", 1);
+	}
+	col_put(c, COL_NAMES, o->name, strlen(o->name));
+	off = c->len[COL_NAMES];
+	col_put(c, COL_OFFSETS, &off, sizeof(off));
+	c->nobjs++;
+}
+
+
+static void
+columns_close(struct sink *s)
+{
+	(void) s;
+}
+
+
+static void
+columns_free(struct columns *c)
+{
+	int	i;
+
+	for (i = 0; i < NCOLS; i++)
+		free(c->data[i]);
+	memset(c, 0, sizeof(*c));
+}
+
+
+/*
+ * Check the --fs-profile settings "spec" (selected without a directory),
+ * returns -1 (the error in "error_msg") if they are invalid.
+ */
+static int
+profile_check(const char *spec)
+{
+	jmp_buf	jb;
+
+	if (spec == NULL)
+		return (0);
+
+	error_jmp = &jb;
+	atomic_store(&error_raised, 0);
+	if (setjmp(jb) == 0) {
+		profile_arg = spec;
+		fs_profile_select(NULL);
+	}
+	error_jmp = NULL;
+
+	return (atomic_load(&error_raised) ? -1 : 0);
+}
+
+
+/*
+ * Traverse "root" with "jobs" threads (0: the profile default) and the
+ * "profile" settings (see --fs-profile, NULL: auto) into "c", as main()
+ * does for a single output.
+ * Returns -1 (errno set) if "root" can't be traversed, -2 if the scan
+ * failed (error(), the error in "error_errnum" and "error_msg"), 1 if a
+ * problem occurred during the traversal (reported on stderr), 0 otherwise.
+ */
+static int
+columns_scan(const char *root, const unsigned jobs, const char *profile_spec,
+    struct columns *c)
+{
+	char			 lnvalue[PATH_MAX];
+	FIST_SSTAT		 st;
+	struct sink		 s;
+	const struct pnode	*pn = NULL;
+	struct dnode		*volatile dir = NULL;
+	struct qrec		*q = NULL;
+	pthread_t		 outthr;
+	jmp_buf			 jb;
+	unsigned		 i, n;
+	volatile int		 outthr_started = 0;
+	int			 fd, r, project = -1;
+
+	if ((fd = FS_OPEN(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return (-1);
+	if (FS_LSTAT(root, &st) == -1) {
+		r = errno;
+		FS_CLOSE(fd);
+		errno = r;
+		return (-1);
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.type = &columns_type;
+	s.path = root;
+	s.filter.uid = s.filter.gid = -1;
+	s.data = c;
+
+	/*
+	 * error() jumps back here (from this thread, the other threads get
+	 * the walker to fail), the scan is stopped and its state freed.
+	 */
+	r = 0;
+	error_jmp = &jb;
+	atomic_store(&error_raised, 0);
+	if (setjmp(jb) != 0) {
+		/* Until dir_lookup() takes it over */
+		if (dir == NULL)
+			FS_CLOSE(fd);
+		goto stop;
+	}
+
+	profile_arg = profile_spec;
+	fs_profile_select(root);
+	if ((n = jobs) == 0) {
+		n = profile.jobs_per_cpu * available_cpus();
+		if (n > profile.jobs_max)
+			n = profile.jobs_max;
+	}
+	euid = geteuid();
+
+	sinks = &s;
+	s.type->open(&s);
+
+	pool_start(n);
+	queue.size = budget_fit(QUEUE_SIZE, QUEUE_MIN, BUDGET_QUEUE);
+	if ((queue.ring = malloc(queue.size)) == NULL)
+		error(1, errno, "Unable to allocate output queue");
+	if ((errno = pthread_create(&outthr, NULL, output_thread, NULL)) != 0)
+		error(1, errno, "Unable to create output thread");
+	outthr_started = 1;
+
+	pn = pnode_root(root, &project, 1);
+	output(NULL, root, &st, S_ISLNK(st.st_mode) ? read_link(AT_FDCWD,
+	    root, root, lnvalue) : NULL, project);
+	dir = dnode_new(NULL, root, pn, project);
+	r = dir_lookup(st.st_dev, fd, dir) != 0;
+
+stop:
+	error_jmp = NULL;
+	pool_stop();
+	walk_close();
+	if (outthr_started) {
+		q = queue_reserve(sizeof(*q));
+		q->type = QREC_END;
+		atomic_store_explicit(&queue.head, atomic_load_explicit(
+		    &queue.head, memory_order_relaxed) + q->len,
+		    memory_order_release);
+		pthread_join(outthr, NULL);
+	}
+	dnode_unref(dir);
+	s.type->close(&s);
+	sinks = NULL;
+	if (atomic_load(&error_raised))
+		r = -2;
+
+	/* Ready for the next scan */
+	for (i = 0; i < pool.nthreads; i++)
+		arena_free(&pool.arenas[i]);
+	free(pool.arenas);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.work);
+	pthread_cond_destroy(&pool.done);
+	free(queue.ring);
+	memset(&pool, 0, sizeof(pool));
+	memset(&ctl, 0, sizeof(ctl));
+	memset(&queue, 0, sizeof(queue));
+	memset(&budget, 0, sizeof(budget));
+
+	return (r);
+}
+
+
+/*
+ * Column "i" of "c" as a Python object (which takes the data over).
+ */
+static PyObject *
+column_new(struct columns *c, const int i)
+{
+	Column	*col = NULL;
+
+	if ((col = PyObject_New(Column, &ColumnType)) == NULL)
+		return (NULL);
+	col->data = c->data[i];
+	col->itemsize = (Py_ssize_t) coldefs[i].itemsize;
+	col->len = (Py_ssize_t) (c->len[i] / coldefs[i].itemsize);
+	col->format = coldefs[i].format;
+	c->data[i] = NULL;
+
+	return ((PyObject *) col);
+}
+
+
+static void
+column_dealloc(PyObject *obj)
+{
+	free(((Column *) obj)->data);
+	PyObject_Free(obj);
+}
+
+
+static int
+column_getbuffer(PyObject *obj, Py_buffer *view, int flags)
+{
+	Column	*col = (Column *) obj;
+
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "Column is read-only");
+		view->obj = NULL;
+		return (-1);
+	}
+
+	view->buf = col->data;
+	view->obj = obj;
+	Py_INCREF(obj);
+	view->len = col->len * col->itemsize;
+	view->readonly = 1;
+	view->itemsize = col->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? (char *) col->format : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) ? &col->len : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+	    &col->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+
+	return (0);
+}
+
+
+static Py_ssize_t
+column_length(PyObject *obj)
+{
+	return (((Column *) obj)->len);
+}
+
+
+/*
+ * scan(path, jobs=0, profile=None): dictionary of the columns.
+ */
+static PyObject *
+fistscan_scan(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char	*kwlist[] = { "path", "jobs", "profile", NULL };
+	struct columns	 c;
+	PyObject	*path = NULL, *cols = NULL, *col = NULL, *exc = NULL;
+	const char	*profile_spec = NULL;
+	char		 msg[sizeof(error_msg)];
+	unsigned int	 jobs = 0;
+	int		 r = 0, i, errnum = 0, invalid;
+
+	(void) self;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|Iz", kwlist,
+	    PyUnicode_FSConverter, &path, &jobs, &profile_spec))
+		return (NULL);
+	if (jobs > 1024) {
+		Py_DECREF(path);
+		return (PyErr_Format(PyExc_ValueError,
+		    "Invalid number of jobs %u", jobs));
+	}
+
+	memset(&c, 0, sizeof(c));
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&scan_lock);
+	if ((invalid = profile_check(profile_spec)) == 0)
+		r = columns_scan(PyBytes_AS_STRING(path), jobs, profile_spec,
+		    &c);
+	errnum = r == -1 ? errno : error_errnum;
+	memcpy(msg, error_msg, sizeof(msg));
+	pthread_mutex_unlock(&scan_lock);
+	Py_END_ALLOW_THREADS
+
+	if (invalid) {
+		PyErr_SetString(PyExc_ValueError, msg);
+		goto fail;
+	}
+	if (r == -1) {
+		errno = errnum;
+		PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+		goto fail;
+	}
+	if (r == -2) {
+		if (errnum == ENOMEM)
+			PyErr_SetString(PyExc_MemoryError, msg);
+		else if (errnum == -1)
+			PyErr_SetString(PyExc_RuntimeError, msg);
+		else if ((exc = Py_BuildValue("(is)", errnum, msg)) != NULL) {
+			PyErr_SetObject(PyExc_OSError, exc);
+			Py_DECREF(exc);
+		}
+		goto fail;
+	}
+	if (c.nomem) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+	if (r == 1 && PyErr_WarnFormat(PyExc_RuntimeWarning, 1, "A problem "
+	    "occurred while traversing '%s'", PyBytes_AS_STRING(path)) == -1)
+		goto fail;
+
+	if ((cols = PyDict_New()) == NULL)
+		goto fail;
+	for (i = 0; i < NCOLS; i++) {
+		if ((col = column_new(&c, i)) == NULL
+		    || PyDict_SetItemString(cols, coldefs[i].name, col) == -1) {
+			Py_XDECREF(col);
+			goto fail;
+		}
+		Py_DECREF(col);
+	}
+	Py_DECREF(path);
+
+	return (cols);
+
+fail:
+	Py_XDECREF(cols);
+	Py_DECREF(path);
+	columns_free(&c);
+	return (NULL);
+}
+
+
+static PyBufferProcs column_as_buffer = {
+	column_getbuffer, NULL
+};
+
+static PySequenceMethods column_as_sequence = {
+	.sq_length = column_length
+};
+
+static PyTypeObject ColumnType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "fistscan.Column",
+	.tp_basicsize = sizeof(Column),
+	.tp_dealloc = column_dealloc,
+	.tp_as_sequence = &column_as_sequence,
+	.tp_as_buffer = &column_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Scan column (buffer protocol, read-only)",
+};
+
+static PyMethodDef fistscan_methods[] = {
+	{ "scan", (PyCFunction) (void (*)(void)) fistscan_scan,
+	    METH_VARARGS | METH_KEYWORDS,
+	    "scan(path, jobs=0, profile=None)\n\n"
+	    "Traverse 'path' (with 'jobs' threads and the --fs-profile "
+	    "'profile'),\nreturn a dictionary of columns: uid, gid, mode, "
+	    "nlink, size, blocks,\natime, mtime, ctime, names and "
+	    "name_offsets." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef fistscan_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "fistscan",
+	.m_doc = "Filesystem scan into columns (fist)",
+	.m_size = -1,
+	.m_methods = fistscan_methods,
+};
+
+
+PyMODINIT_FUNC
+PyInit_fistscan(void)
+{
+	PyObject	*m = NULL;
+
+	if (PyType_Ready(&ColumnType) < 0)
+		return (NULL);
+	if ((m = PyModule_Create(&fistscan_module)) == NULL)
+		return (NULL);
+	Py_INCREF(&ColumnType);
+	if (PyModule_AddObject(m, "Column", (PyObject *) &ColumnType) < 0) {
+		Py_DECREF(&ColumnType);
+		Py_DECREF(m);
+		return (NULL);
+	}
+
+	return (m);
+}
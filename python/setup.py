@@ -0,0 +1,21 @@
+#
+# "fistscan" Python module (see fistscan.c):
+#	python3 setup.py build_ext --inplace
+#
+from setuptools import Extension, setup
+
+setup(
+    name="fistscan",
+    version="1.99",
+    description="Filesystem scan into columns (fist)",
+    ext_modules=[
+        Extension(
+            "fistscan",
+            sources=["fistscan.c"],
+            depends=["../fist.c", "../fist.h"],
+            define_macros=[("NEED_STAT64", None)],
+            extra_compile_args=["-fvisibility=hidden"],
+            extra_link_args=["-pthread", "-lm"],
+        )
+    ],
+)
@@ -0,0 +1,714 @@
+/*
+ * Copyright (c) 2006-2024 IN2P3 Computing Centre
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * Simulated filesystem for "fist-simfs": a synthetic tree served with the
+ * latencies and the concurrency limit of a (remote) filesystem, so that
+ * the traversal scheduling can be evaluated without one.
+ *
+ * The FIST_SIMFS environment variable is a comma separated list of:
+ *  depth=N	depth of the tree (4)
+ *  dirs=N	sub-directories per directory above the maximum depth (4)
+ *  files=N	files per directory (32)
+ *  links=N	symlinks per directory (2)
+ *  seed=N	objects attributes seed (1)
+ *  lat=const|exp|lognormal
+ *		requests latency distribution (exp)
+ *  mean=N	mean latency of a request, in microseconds (500)
+ *  sigma=F	shape of the lognormal distribution (1.0)
+ *  readdir=N	mean latency of a directory read, in microseconds (mean)
+ *  page=N	directory entries returned per directory read (64)
+ *  inflight=N	maximum number of requests served at once, the others are
+ *		queued (0: no limit)
+ *  dtype=0|1	object types in directory entries (1)
+ *
+ * Directories are "dN", files "fN" and symlinks "lN", the attributes of
+ * an object are derived from its inode number, so the tree is the same
+ * for a given configuration. Any directory name is the root of the tree.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "simfs.h"
+
+#define SIM_FDBASE	(1 << 24)	/* simulated descriptors */
+#define SIM_DEV		0x51f5
+#define SIM_EPOCH	1700000000	/* objects are older than this */
+
+enum sim_op { SIM_OPEN, SIM_READDIR, SIM_STAT, SIM_READLINK, SIM_NOPS };
+
+enum sim_lat { LAT_CONST, LAT_EXP, LAT_LOGNORMAL };
+
+/*
+ * An open directory, "id" is its number in the tree (0 for the root, the
+ * sub-directories of "id" are "id * dirs + 1" to "id * dirs + dirs").
+ */
+struct sim_fd {
+	int		 used;
+	unsigned	 depth;
+	uint64_t	 id;
+};
+
+/*
+ * Directory stream (handed out as a "DIR *").
+ */
+struct sim_dir {
+	int		 fd;
+	unsigned	 depth;
+	uint64_t	 id;
+	size_t		 pos;
+	size_t		 n;
+	struct dirent	 de;
+};
+
+static struct {
+	unsigned	 depth;
+	unsigned	 dirs;
+	unsigned	 files;
+	unsigned	 links;
+	uint64_t	 seed;
+	enum sim_lat	 lat;
+	double		 mean;		/* microseconds */
+	double		 sigma;
+	double		 readdir;	/* microseconds */
+	unsigned	 page;
+	unsigned	 inflight;
+	int		 dtype;
+} cfg = { 4, 4, 32, 2, 1, LAT_EXP, 500, 1.0, -1, 64, 0, 1 };
+
+static pthread_once_t	 once = PTHREAD_ONCE_INIT;
+
+/* Open directories */
+static pthread_mutex_t	 fdlock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_fd	*fds = NULL;
+static size_t		 nfds = 0;
+
+/* Requests being served */
+static pthread_mutex_t	 slotlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 slotfree = PTHREAD_COND_INITIALIZER;
+static unsigned		 busy = 0, peak = 0;
+
+static atomic_uint_fast64_t	 nops[SIM_NOPS];
+static atomic_uint_fast64_t	 lat_ns[SIM_NOPS];
+static atomic_uint_fast64_t	 wait_ns[SIM_NOPS];
+static atomic_uint		 nthreads;
+
+static __thread uint64_t	 rng = 0;	/* per thread */
+
+static const char	*op_names[SIM_NOPS] = {
+	"open", "readdir", "stat", "readlink"
+};
+
+static void		 sim_init(void);
+static void		 sim_error(const char *, ...);
+static uint64_t		 mix(uint64_t);
+static double		 uniform(void);
+static double		 sample(double);
+static uint64_t		 now_ns(void);
+static void		 sim_request(enum sim_op);
+static int		 fd_get(int, struct sim_fd *);
+static int		 fd_new(uint64_t, unsigned);
+static int		 lookup(const struct sim_fd *, const char *, char *,
+    uint64_t *);
+static uint64_t		 ino_of(uint64_t, char, uint64_t);
+static void		 attrs(const struct sim_fd *, char, uint64_t,
+    struct stat *);
+
+
+/*
+ * Configuration from the environment, once.
+ */
+static void
+sim_init(void)
+{
+	char		*env = NULL, *opt = NULL, *val = NULL, *end = NULL;
+	char		*last = NULL;
+	double		 v;
+
+	if ((env = getenv("FIST_SIMFS")) == NULL || *env == '\0')
+		goto done;
+	if ((env = strdup(env)) == NULL)
+		sim_error("Unable to allocate configuration");
+
+	for (opt = strtok_r(env, ",", &last); opt != NULL;
+	    opt = strtok_r(NULL, ",", &last)) {
+		if ((val = strchr(opt, '=')) == NULL)
+			sim_error("Invalid FIST_SIMFS option '%s'", opt);
+		*val++ = '\0';
+
+		if (strcmp(opt, "lat") == 0) {
+			if (strcmp(val, "const") == 0)
+				cfg.lat = LAT_CONST;
+			else if (strcmp(val, "exp") == 0)
+				cfg.lat = LAT_EXP;
+			else if (strcmp(val, "lognormal") == 0)
+				cfg.lat = LAT_LOGNORMAL;
+			else
+				sim_error("Invalid latency distribution '%s'",
+				    val);
+			continue;
+		}
+
+		errno = 0;
+		v = strtod(val, &end);
+		if (errno != 0 || end == val || *end != '\0' || v < 0)
+			sim_error("Invalid FIST_SIMFS value '%s=%s'", opt,
+			    val);
+
+		if (strcmp(opt, "depth") == 0)
+			cfg.depth = (unsigned) v;
+		else if (strcmp(opt, "dirs") == 0)
+			cfg.dirs = (unsigned) v;
+		else if (strcmp(opt, "files") == 0)
+			cfg.files = (unsigned) v;
+		else if (strcmp(opt, "links") == 0)
+			cfg.links = (unsigned) v;
+		else if (strcmp(opt, "seed") == 0)
+			cfg.seed = (uint64_t) v;
+		else if (strcmp(opt, "mean") == 0)
+			cfg.mean = v;
+		else if (strcmp(opt, "sigma") == 0)
+			cfg.sigma = v;
+		else if (strcmp(opt, "readdir") == 0)
+			cfg.readdir = v;
+		else if (strcmp(opt, "page") == 0)
+			cfg.page = (unsigned) v;
+		else if (strcmp(opt, "inflight") == 0)
+			cfg.inflight = (unsigned) v;
+		else if (strcmp(opt, "dtype") == 0)
+			cfg.dtype = v != 0;
+		else
+			sim_error("Unknown FIST_SIMFS option '%s'", opt);
+	}
+	free(env);
+
+done:
+	if (cfg.readdir < 0)
+		cfg.readdir = cfg.mean;
+	if (cfg.page == 0)
+		cfg.page = 1;
+}
+
+
+static void
+sim_error(const char *fmt, ...)
+{
+	va_list	 ap;
+
+	fprintf(stderr, "fist: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+
+/*
+ * "splitmix64" finalizer: attributes and random numbers generator seeds.
+ */
+static uint64_t
+mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31));
+}
+
+
+/*
+ * Uniform in ]0, 1[, with a per thread "xorshift64*" generator.
+ */
+static double
+uniform(void)
+{
+	if (rng == 0)
+		rng = mix(cfg.seed + atomic_fetch_add(&nthreads, 1)) | 1;
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((((rng * 0x2545f4914f6cdd1dULL) >> 11) + 0.5)
+	    / 9007199254740992.0);
+}
+
+
+/*
+ * A latency (in microseconds) from the configured distribution.
+ */
+static double
+sample(const double mean)
+{
+	double	 mu, z;
+
+	switch (cfg.lat) {
+	case LAT_CONST:
+		return (mean);
+	case LAT_EXP:
+		return (-mean * log(uniform()));
+	case LAT_LOGNORMAL:
+		/* Box-Muller, with the same mean as the other ones */
+		z = sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+		mu = log(mean > 0 ? mean : 1e-3) - cfg.sigma * cfg.sigma / 2;
+		return (mean > 0 ? exp(mu + cfg.sigma * z) : 0);
+	default:
+		return (0);
+	}
+}
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+
+/*
+ * A request to the simulated server: wait for a free slot (if the number
+ * of requests in flight is limited), then for the latency of the request.
+ */
+static void
+sim_request(const enum sim_op op)
+{
+	struct timespec	 ts;
+	uint64_t	 t0, t1, d;
+
+	pthread_once(&once, sim_init);
+
+	t0 = now_ns();
+	pthread_mutex_lock(&slotlock);
+	while (cfg.inflight > 0 && busy >= cfg.inflight)
+		pthread_cond_wait(&slotfree, &slotlock);
+	if (++busy > peak)
+		peak = busy;
+	pthread_mutex_unlock(&slotlock);
+	t1 = now_ns();
+
+	d = (uint64_t) (sample(op == SIM_READDIR ? cfg.readdir : cfg.mean)
+	    * 1000);
+	if (d > 0) {
+		ts.tv_sec = (time_t) (d / 1000000000);
+		ts.tv_nsec = (long) (d % 1000000000);
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+
+	pthread_mutex_lock(&slotlock);
+	busy--;
+	pthread_cond_signal(&slotfree);
+	pthread_mutex_unlock(&slotlock);
+
+	atomic_fetch_add(&nops[op], 1);
+	atomic_fetch_add(&wait_ns[op], t1 - t0);
+	atomic_fetch_add(&lat_ns[op], now_ns() - t0);
+}
+
+
+/*
+ * Copy of the open directory "fd", -1 (EBADF) if there's none.
+ */
+static int
+fd_get(const int fd, struct sim_fd *sfd)
+{
+	int	 r = -1;
+
+	pthread_mutex_lock(&fdlock);
+	if (fd >= SIM_FDBASE && (size_t) (fd - SIM_FDBASE) < nfds
+	    && fds[fd - SIM_FDBASE].used) {
+		*sfd = fds[fd - SIM_FDBASE];
+		r = 0;
+	}
+	pthread_mutex_unlock(&fdlock);
+
+	if (r == -1)
+		errno = EBADF;
+	return (r);
+}
+
+
+static int
+fd_new(const uint64_t id, const unsigned depth)
+{
+	struct sim_fd	*p = NULL;
+	size_t		 i;
+
+	pthread_mutex_lock(&fdlock);
+	for (i = 0; i < nfds && fds[i].used; i++)
+		;
+	if (i == nfds) {
+		if ((p = realloc(fds, (nfds + 64) * sizeof(*fds))) == NULL) {
+			pthread_mutex_unlock(&fdlock);
+			errno = EMFILE;
+			return (-1);
+		}
+		fds = p;
+		memset(fds + nfds, 0, 64 * sizeof(*fds));
+		nfds += 64;
+	}
+	fds[i].used = 1;
+	fds[i].id = id;
+	fds[i].depth = depth;
+	pthread_mutex_unlock(&fdlock);
+
+	return (SIM_FDBASE + (int) i);
+}
+
+
+/*
+ * Object "name" in directory "dir": its type ('d', 'f' or 'l') and number
+ * (a directory number in the tree for 'd', its rank otherwise).
+ */
+static int
+lookup(const struct sim_fd *dir, const char *name, char *type, uint64_t *n)
+{
+	char		 buf[32];
+	unsigned long	 k;
+	unsigned	 max;
+
+	*type = name[0];
+	switch (*type) {
+	case 'd':
+		max = dir->depth < cfg.depth ? cfg.dirs : 0;
+		break;
+	case 'f':
+		max = cfg.files;
+		break;
+	case 'l':
+		max = cfg.links;
+		break;
+	default:
+		errno = ENOENT;
+		return (-1);
+	}
+
+	k = strtoul(name + 1, NULL, 10);
+	snprintf(buf, sizeof(buf), "%c%lu", *type, k);
+	if (k >= max || strcmp(buf, name) != 0) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	*n = *type == 'd' ? dir->id * cfg.dirs + k + 1 : k;
+	return (0);
+}
+
+
+/*
+ * Inode number of object "n" (of "type") in directory "id".
+ */
+static uint64_t
+ino_of(const uint64_t id, const char type, const uint64_t n)
+{
+	uint64_t	 stride = 2 + (uint64_t) cfg.files + cfg.links;
+
+	switch (type) {
+	case 'd':
+		return (n * stride + 1);
+	case 'f':
+		return (id * stride + 2 + n);
+	default:
+		return (id * stride + 2 + cfg.files + n);
+	}
+}
+
+
+static void
+attrs(const struct sim_fd *dir, const char type, const uint64_t n,
+    struct stat *st)
+{
+	uint64_t	 h;
+
+	memset(st, 0, sizeof(*st));
+	st->st_dev = SIM_DEV;
+	st->st_ino = (ino_t) ino_of(dir->id, type, n);
+	h = mix(cfg.seed ^ st->st_ino);
+
+	switch (type) {
+	case 'd':
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2 + (dir->depth + 1 < cfg.depth ? cfg.dirs : 0);
+		st->st_size = 4096;
+		break;
+	case 'f':
+		st->st_mode = S_IFREG | 0644;
+		st->st_nlink = 1;
+		/* Mostly small files, some large ones */
+		st->st_size = (off_t) (h % 65536)
+		    << ((h >> 56) % 8 == 0 ? 10 : 0);
+		break;
+	default:
+		st->st_mode = S_IFLNK | 0777;
+		st->st_nlink = 1;
+		st->st_size = (off_t) snprintf(NULL, 0, "f%" PRIu64,
+		    cfg.files > 0 ? n % cfg.files : n);
+		break;
+	}
+	st->st_uid = (uid_t) (1000 + (h >> 16) % 8);
+	st->st_gid = (gid_t) (100 + (h >> 24) % 4);
+	st->st_blocks = (st->st_size + 511) / 512;
+	st->st_blksize = 4096;
+	st->st_mtime = SIM_EPOCH - (time_t) ((h >> 32) % (3 * 365 * 86400));
+	st->st_atime = st->st_mtime + (time_t) ((h >> 8) % 86400);
+	st->st_ctime = st->st_mtime;
+}
+
+
+/*
+ * Any directory is the root of the tree.
+ */
+int
+sim_open(const char *path, const int flags)
+{
+	(void) path;
+	(void) flags;
+
+	sim_request(SIM_OPEN);
+	return (fd_new(0, 0));
+}
+
+
+int
+sim_openat(const int dfd, const char *name, const int flags)
+{
+	struct sim_fd	 dir;
+	uint64_t	 n;
+	char		 type;
+
+	sim_request(SIM_OPEN);
+	if (fd_get(dfd, &dir) == -1 || lookup(&dir, name, &type, &n) == -1)
+		return (-1);
+	if (type == 'l' && (flags & O_NOFOLLOW)) {
+		errno = ELOOP;
+		return (-1);
+	}
+	if (type != 'd') {
+		errno = ENOTDIR;
+		return (-1);
+	}
+
+	return (fd_new(n, dir.depth + 1));
+}
+
+
+int
+sim_close(const int fd)
+{
+	struct sim_fd	 dir;
+
+	if (fd_get(fd, &dir) == -1)
+		return (-1);
+	pthread_mutex_lock(&fdlock);
+	fds[fd - SIM_FDBASE].used = 0;
+	pthread_mutex_unlock(&fdlock);
+
+	return (0);
+}
+
+
+DIR *
+sim_fdopendir(const int fd)
+{
+	struct sim_dir	*d = NULL;
+	struct sim_fd	 dir;
+
+	if (fd_get(fd, &dir) == -1)
+		return (NULL);
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		return (NULL);
+	d->fd = fd;
+	d->id = dir.id;
+	d->depth = dir.depth;
+	d->n = 2 + (dir.depth < cfg.depth ? cfg.dirs : 0) + (size_t) cfg.files
+	    + cfg.links;
+
+	return ((DIR *) d);
+}
+
+
+/*
+ * ".", "..", then the directories, files and symlinks, one request per
+ * "page" of entries.
+ */
+struct dirent *
+sim_readdir(DIR *dirp)
+{
+	struct sim_dir	*d = (struct sim_dir *) dirp;
+	size_t		 k, nd;
+	char		 type = 'f';
+
+	if (d->pos % cfg.page == 0)
+		sim_request(SIM_READDIR);
+	if (d->pos >= d->n)
+		return (NULL);
+
+	k = d->pos++;
+	nd = d->depth < cfg.depth ? cfg.dirs : 0;
+	memset(&d->de, 0, sizeof(d->de));
+	if (k < 2) {
+		snprintf(d->de.d_name, sizeof(d->de.d_name), "%s",
+		    k == 0 ? "." : "..");
+		type = 'd';
+		d->de.d_ino = k == 0 ? ino_of(0, 'd', d->id) : 0;
+	} else if ((k -= 2) < nd) {
+		snprintf(d->de.d_name, sizeof(d->de.d_name), "d%zu", k);
+		type = 'd';
+		d->de.d_ino = ino_of(d->id, 'd', d->id * cfg.dirs + k + 1);
+	} else if ((k -= nd) < cfg.files) {
+		snprintf(d->de.d_name, sizeof(d->de.d_name), "f%zu", k);
+		d->de.d_ino = ino_of(d->id, 'f', k);
+	} else {
+		k -= cfg.files;
+		snprintf(d->de.d_name, sizeof(d->de.d_name), "l%zu", k);
+		type = 'l';
+		d->de.d_ino = ino_of(d->id, 'l', k);
+	}
+#ifdef DT_DIR
+	if (!cfg.dtype)
+		d->de.d_type = DT_UNKNOWN;
+	else
+		d->de.d_type = type == 'd' ? DT_DIR
+		    : type == 'l' ? DT_LNK : DT_REG;
+#endif /* DT_DIR */
+
+	return (&d->de);
+}
+
+
+int
+sim_closedir(DIR *dirp)
+{
+	struct sim_dir	*d = (struct sim_dir *) dirp;
+	int		 r;
+
+	r = sim_close(d->fd);
+	free(d);
+
+	return (r);
+}
+
+
+int
+sim_fstat(const int fd, struct stat *st)
+{
+	struct sim_fd	 dir, parent = { 1, 0, 0 };
+
+	sim_request(SIM_STAT);
+	if (fd_get(fd, &dir) == -1)
+		return (-1);
+	/* "attrs()" uses the depth of the parent directory */
+	parent.depth = dir.depth - 1;
+	attrs(&parent, 'd', dir.id, st);
+
+	return (0);
+}
+
+
+int
+sim_fstatat(const int dfd, const char *name, struct stat *st,
+    const int flags)
+{
+	struct sim_fd	 dir;
+	uint64_t	 n;
+	char		 type;
+
+	(void) flags;
+
+	sim_request(SIM_STAT);
+	if (fd_get(dfd, &dir) == -1 || lookup(&dir, name, &type, &n) == -1)
+		return (-1);
+	attrs(&dir, type, n, st);
+
+	return (0);
+}
+
+
+int
+sim_lstat(const char *path, struct stat *st)
+{
+	struct sim_fd	 parent = { 1, (unsigned) -1, 0 };
+
+	(void) path;
+
+	sim_request(SIM_STAT);
+	attrs(&parent, 'd', 0, st);
+
+	return (0);
+}
+
+
+ssize_t
+sim_readlinkat(const int dfd, const char *name, char *buf, const size_t len)
+{
+	struct sim_fd	 dir;
+	uint64_t	 n;
+	char		 type;
+	int		 r;
+
+	sim_request(SIM_READLINK);
+	if (fd_get(dfd, &dir) == -1 || lookup(&dir, name, &type, &n) == -1)
+		return (-1);
+	if (type != 'l') {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	r = snprintf(buf, len, "f%" PRIu64, cfg.files > 0 ? n % cfg.files : n);
+	return (r < 0 ? -1 : (size_t) r < len ? r : (ssize_t) len);
+}
+
+
+/*
+ * Requests statistics.
+ */
+void
+sim_report(FILE *fp)
+{
+	uint64_t	 n;
+	int		 i;
+
+	for (i = 0; i < SIM_NOPS; i++) {
+		if ((n = atomic_load(&nops[i])) == 0)
+			continue;
+		fprintf(fp, "fist: simfs %s: %" PRIu64 " requests, average "
+		    "%.0f us (%.0f us queued)\n", op_names[i], n,
+		    atomic_load(&lat_ns[i]) / 1e3 / n,
+		    atomic_load(&wait_ns[i]) / 1e3 / n);
+	}
+	fprintf(fp, "fist: simfs: at most %u requests in flight "
+	    "(limit %u)\n", peak, cfg.inflight);
+}
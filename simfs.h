@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2006-2024 IN2P3 Computing Centre
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * Simulated filesystem, for "fist-simfs" (fist built with -DFIST_SIMFS):
+ * the traversal system calls are replaced by these functions, which serve
+ * a synthetic tree with injected latencies and a concurrency limit.
+ * The tree and the latencies are set with the FIST_SIMFS environment
+ * variable (see simfs.c).
+ */
+
+#ifndef SIMFS_H
+#define SIMFS_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <stdio.h>
+
+int		 sim_open(const char *, int);
+int		 sim_openat(int, const char *, int);
+int		 sim_close(int);
+DIR		*sim_fdopendir(int);
+struct dirent	*sim_readdir(DIR *);
+int		 sim_closedir(DIR *);
+int		 sim_fstat(int, struct stat *);
+int		 sim_fstatat(int, const char *, struct stat *, int);
+int		 sim_lstat(const char *, struct stat *);
+ssize_t		 sim_readlinkat(int, const char *, char *, size_t);
+void		 sim_report(FILE *);
+
+#endif /* SIMFS_H */